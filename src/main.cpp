@@ -2,7 +2,8 @@
 #include <fstream>
 #include <string>
 #include <vector>
-#include <cstdlib>   // getenv
+#include <cstdlib>
+#include <charconv>
 #include <unistd.h>  // access
 #include <sys/wait.h>
 #include <filesystem>
@@ -16,11 +17,146 @@
 #include <cctype>
 #include <cerrno>
 #include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <string_view>
+#include <sys/epoll.h>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 
 
 namespace fs = std::filesystem;
 
-std::vector<std::string> history;
+struct sv_hash {
+  using is_transparent = void;
+  size_t operator()(std::string_view s) const { return std::hash<std::string_view>{}(s); }
+};
+
+//string atoms shared by history, the PATH cache and completion: each distinct string
+//is stored once, NUL terminated, in 64 KiB chunks and named by a dense id. Atoms are
+//reference counted; once freed bytes outweigh live ones the chunks are compacted.
+//Ids never change, but a view or c_str() taken before atom_release() may move.
+using atom_t = uint32_t;
+
+struct string_arena {
+  struct entry {
+    const char* p;
+    uint32_t len;
+    uint32_t refs;
+  };
+  static constexpr size_t CHUNK = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  size_t chunk_left = 0;
+  char* chunk_next = nullptr;
+  std::vector<entry> entries;
+  std::vector<atom_t> free_ids;
+  std::unordered_map<std::string_view, atom_t, sv_hash> index;
+  size_t live_bytes = 0;
+  size_t dead_bytes = 0;
+};
+
+static string_arena atoms;
+
+static char* arena_alloc(size_t n){
+  if(n > atoms.chunk_left){
+    size_t size = std::max(n, string_arena::CHUNK);
+    atoms.chunks.emplace_back(new char[size]);
+    atoms.chunk_next = atoms.chunks.back().get();
+    atoms.chunk_left = size;
+  }
+  char* p = atoms.chunk_next;
+  atoms.chunk_next += n;
+  atoms.chunk_left -= n;
+  return p;
+}
+
+inline std::string_view atom_view(atom_t a){
+  return {atoms.entries[a].p, atoms.entries[a].len};
+}
+
+inline const char* atom_cstr(atom_t a){
+  return atoms.entries[a].p;
+}
+
+//returns the atom for s with one more reference
+static atom_t atom_intern(std::string_view s){
+  auto it = atoms.index.find(s);
+  if(it != atoms.index.end()){
+    atoms.entries[it->second].refs++;
+    return it->second;
+  }
+
+  char* p = arena_alloc(s.size() + 1);
+  memcpy(p, s.data(), s.size());
+  p[s.size()] = '\0';
+
+  atom_t a;
+  if(!atoms.free_ids.empty()){
+    a = atoms.free_ids.back();
+    atoms.free_ids.pop_back();
+  }
+  else{
+    a = (atom_t)atoms.entries.size();
+    atoms.entries.emplace_back();
+  }
+  atoms.entries[a] = {p, (uint32_t)s.size(), 1};
+  atoms.index.emplace(std::string_view(p, s.size()), a);
+  atoms.live_bytes += s.size() + 1;
+  return a;
+}
+
+static void atom_retain(atom_t a){
+  atoms.entries[a].refs++;
+}
+
+//copies the live strings into fresh chunks; ids stay, their bytes move
+static void arena_compact(){
+  std::vector<std::unique_ptr<char[]>> old = std::move(atoms.chunks);
+  atoms.chunks.clear();
+  atoms.chunk_left = 0;
+  atoms.index.clear();
+  for(atom_t a = 0; a < atoms.entries.size(); a++){
+    auto& e = atoms.entries[a];
+    if(!e.refs) continue;
+    char* p = arena_alloc(e.len + 1);
+    memcpy(p, e.p, e.len + 1);
+    e.p = p;
+    atoms.index.emplace(std::string_view(p, e.len), a);
+  }
+  atoms.dead_bytes = 0;
+}
+
+static void atom_release(atom_t a){
+  auto& e = atoms.entries[a];
+  if(--e.refs) return;
+  atoms.index.erase(std::string_view(e.p, e.len));
+  atoms.free_ids.push_back(a);
+  atoms.live_bytes -= e.len + 1;
+  atoms.dead_bytes += e.len + 1;
+  if(atoms.dead_bytes > string_arena::CHUNK * 16 && atoms.dead_bytes > atoms.live_bytes){
+    arena_compact();
+  }
+}
+
+std::vector<atom_t> history;
 const size_t HISTORY_LIMIT = 1000;
 std::string HISTFILE;
 size_t session_start_index = 0;
@@ -28,22 +164,182 @@ size_t session_start_index = 0;
 enum class histpersistence { WRITE , APPEND };
 constexpr histpersistence HIST_MODE = histpersistence::APPEND;
 
-static std::vector<std::string> completion_pool;
+//joins the background startup work (history and PATH cache), see main
+static void startup_sync();
 
-static std::vector<std::string> path_exec_cache;
+static std::vector<atom_t> completion_pool;     //points into path_exec_cache and builtin_atoms
+static uint64_t completion_generation = 0;      //path_cache_generation the pool was built for
+
+static std::vector<atom_t> path_exec_cache;
+static uint64_t path_cache_generation = 0;
 static std::string cached_path_env;
 
 static bool path_cache_built = false;
 
+static bool shell_exit_requested = false;
+static int shell_exit_status = 0;
+static int last_status = 0;   //$?
+
+//set -o options
+static bool opt_pipefail = false;   //a pipeline fails with its rightmost failing stage
+static bool opt_pipekill = false;   //a failing stage SIGPIPEs the stages still running
+static bool opt_fastutils = false;  //grep, wc and head run as builtins when their options allow
+static bool opt_zygote = false;     //external commands are started by the zygote helper
+
+//pending break/continue levels and return, checked after every command
+static int loop_depth = 0;
+static int loop_break = 0;
+static int loop_continue = 0;
+static bool func_returning = false;
+static int return_status = 0;
+
+static inline bool ctl_pending(){
+  return shell_exit_requested || loop_break || loop_continue || func_returning;
+}
+
+static const std::pair<const char*, bool*> shell_options[] = {
+  {"pipefail", &opt_pipefail},
+  {"pipekill", &opt_pipekill},
+  {"fastutils", &opt_fastutils},
+  {"zygote", &opt_zygote},
+};
+
+//shell variables, names are interned to dense ids so a lookup is one hash and then an index
+struct shell_var {
+  std::string value;
+  bool set = false;
+  bool exported = false;
+};
+
+static constexpr uint32_t VAR_NONE = UINT32_MAX;
+
+static std::unordered_map<std::string, uint32_t, sv_hash, std::equal_to<>> var_ids;
+static std::vector<std::string> var_names;
+static std::vector<shell_var> vars;
+
+//"NAME=value" strings of exported variables, rebuilt only after an exported variable changes
+static std::vector<std::string> env_strings;
+static std::vector<char*> env_cache;
+static bool env_dirty = true;
+
+//PATH lookups are remembered until PATH changes, like bash's hash table
+static std::unordered_map<std::string, std::string> command_hash;
+
+uint32_t var_find(std::string_view name){
+  auto it = var_ids.find(name);
+  return it == var_ids.end() ? VAR_NONE : it->second;
+}
+
+uint32_t var_intern(std::string_view name){
+  uint32_t id = var_find(name);
+  if(id != VAR_NONE) return id;
+
+  id = (uint32_t)var_names.size();
+  var_names.emplace_back(name);
+  vars.emplace_back();
+  var_ids.emplace(var_names.back(), id);
+  return id;
+}
+
+const std::string* var_get(uint32_t id){
+  if(id == VAR_NONE || !vars[id].set) return nullptr;
+  return &vars[id].value;
+}
+
+//getenv() replacement, the pointer is valid until the variable changes
+const char* var_cstr(std::string_view name){
+  const std::string* v = var_get(var_find(name));
+  return v ? v->c_str() : nullptr;
+}
+
+static void var_changed(uint32_t id){
+  if(vars[id].exported) env_dirty = true;
+  if(var_names[id] == "PATH") command_hash.clear();
+}
+
+void var_set(uint32_t id, std::string value){
+  shell_var& v = vars[id];
+  v.value = std::move(value);
+  v.set = true;
+  var_changed(id);
+}
+
+void var_export(uint32_t id){
+  if(!vars[id].exported){
+    vars[id].exported = true;
+    if(vars[id].set) env_dirty = true;
+  }
+}
+
+void var_unset(uint32_t id){
+  if(id == VAR_NONE) return;
+  var_changed(id);
+  vars[id] = shell_var{};
+}
+
+static bool is_var_name(std::string_view s){
+  if(s.empty() || !(isalpha((unsigned char)s[0]) || s[0] == '_')) return false;
+  for(char c : s){
+    if(!(isalnum((unsigned char)c) || c == '_')) return false;
+  }
+  return true;
+}
+
+//the envp handed to execve, rebuilt only when dirty
+char** shell_envp(){
+  if(env_dirty){
+    env_strings.clear();
+    env_cache.clear();
+    for(uint32_t id = 0; id < vars.size(); id++){
+      if(vars[id].set && vars[id].exported){
+        env_strings.push_back(var_names[id] + "=" + vars[id].value);
+      }
+    }
+    for(auto& e : env_strings){
+      env_cache.push_back(e.data());
+    }
+    env_cache.push_back(nullptr);
+    env_dirty = false;
+  }
+  return env_cache.data();
+}
+
+//positional parameters and the variables a running function made local
+struct call_frame {
+  std::vector<std::string> args;
+  std::vector<std::pair<uint32_t, shell_var>> locals;
+};
+
+static std::vector<call_frame> call_stack;
+static constexpr size_t FUNC_MAX_DEPTH = 1000;
+
+static const std::vector<std::string>& positional(){
+  static const std::vector<std::string> none;
+  return call_stack.empty() ? none : call_stack.back().args;
+}
+
+//the inherited environment becomes the initial set of exported variables
+static void vars_import(char** env){
+  for(char** e = env; e && *e; ++e){
+    const char* eq = strchr(*e, '=');
+    if(!eq) continue;
+    std::string_view name(*e, eq - *e);
+    if(!is_var_name(name)) continue;
+    uint32_t id = var_intern(name);
+    var_set(id, eq + 1);
+    var_export(id);
+  }
+}
+
 //funtion to resolve histfile
 std::string get_histfile(){
 
-  const char* hf = getenv("HISTFILE");
+  const char* hf = var_cstr("HISTFILE");
   if(hf && *hf){
     return hf;
   }
 
-  const char* home = getenv("HOME");
+  const char* home = var_cstr("HOME");
   if(home && *home){
     return std::string(home) + "/.my_shell_history";
   }
@@ -51,6 +347,107 @@ std::string get_histfile(){
   return ".my_shell_history";
 }
 
+static bool write_all(int fd, const char* data, size_t len);
+
+//every entry gets a sequence number, kept in history_seq alongside history; erasing
+//keeps it sorted, so an entry is found again by binary search
+static std::vector<uint64_t> history_seq;
+static uint64_t history_next_seq = 0;
+
+//where each atom is in history, as the ascending sequence numbers of its copies: lines
+//are atoms, so "is this command already in history" is one hash lookup
+static std::unordered_map<atom_t, std::vector<uint64_t>> history_index;
+
+static void history_push(atom_t a){
+  history.push_back(a);
+  history_seq.push_back(history_next_seq);
+  history_index[a].push_back(history_next_seq++);
+}
+
+//unindexes and releases history[i]; the caller erases it from history and history_seq
+static void history_forget(size_t i){
+  auto it = history_index.find(history[i]);
+  auto& seqs = it->second;
+  seqs.erase(std::lower_bound(seqs.begin(), seqs.end(), history_seq[i]));
+  if(seqs.empty()) history_index.erase(it);
+  atom_release(history[i]);
+}
+
+static void history_erase(size_t i){
+  history_forget(i);
+  history.erase(history.begin() + i);
+  history_seq.erase(history_seq.begin() + i);
+  if(i < session_start_index) session_start_index--;
+}
+
+//drops the oldest entries beyond HISTORY_LIMIT
+static void history_trim(){
+  if(history.size() <= HISTORY_LIMIT) return;
+  size_t extra = history.size() - HISTORY_LIMIT;
+  for(size_t i = 0; i < extra; i++) history_forget(i);
+  history.erase(history.begin() , history.begin() + extra);
+  history_seq.erase(history_seq.begin() , history_seq.begin() + extra);
+  session_start_index -= std::min(extra, session_start_index);
+}
+
+static void history_clear(){
+  for(atom_t h : history) atom_release(h);
+  history.clear();
+  history_seq.clear();
+  history_index.clear();
+}
+
+//HISTCONTROL, a colon separated list as in bash
+enum { HC_IGNOREDUPS = 1, HC_ERASEDUPS = 2, HC_IGNORESPACE = 4 };
+
+static int histcontrol(){
+  const char* v = var_cstr("HISTCONTROL");
+  if(!v) return 0;
+  int flags = 0;
+  std::string_view rest = v;
+  while(!rest.empty()){
+    size_t colon = rest.find(':');
+    std::string_view opt = rest.substr(0, colon);
+    if(opt == "ignoredups") flags |= HC_IGNOREDUPS;
+    else if(opt == "erasedups") flags |= HC_ERASEDUPS;
+    else if(opt == "ignorespace") flags |= HC_IGNORESPACE;
+    else if(opt == "ignoreboth") flags |= HC_IGNOREDUPS | HC_IGNORESPACE;
+    if(colon == std::string_view::npos) break;
+    rest.remove_prefix(colon + 1);
+  }
+  return flags;
+}
+
+//adds an interactive line subject to HISTCONTROL, false when it is not kept
+static bool history_add(const std::string& line){
+  int hc = histcontrol();
+  if((hc & HC_IGNORESPACE) && !line.empty() && line[0] == ' ') return false;
+
+  atom_t a = atom_intern(line);
+  if((hc & HC_IGNOREDUPS) && !history.empty() && history.back() == a){
+    atom_release(a);
+    return false;
+  }
+
+  auto dup = history_index.find(a);
+  if((hc & HC_ERASEDUPS) && dup != history_index.end()){
+    //readline's list mirrors ours while their lengths agree
+    bool mirrored = history_length == (int)history.size();
+    std::vector<uint64_t> copies = dup->second;
+    for(auto s = copies.rbegin(); s != copies.rend(); ++s){
+      size_t i = std::lower_bound(history_seq.begin(), history_seq.end(), *s) - history_seq.begin();
+      history_erase(i);
+      if(mirrored){
+        if(HIST_ENTRY* e = remove_history((int)i)) free_history_entry(e);
+      }
+    }
+  }
+
+  history_push(a);
+  history_trim();
+  return true;
+}
+
 //read history on startup
 size_t history_read_file(const std::string& path){
 
@@ -64,47 +461,170 @@ size_t history_read_file(const std::string& path){
     if(line.empty()){
       continue;
     }
-    history.push_back(line);
+    history_push(atom_intern(line));
   }
 
-  if(history.size() > HISTORY_LIMIT){
-    size_t extra = history.size() - HISTORY_LIMIT;
-    history.erase(history.begin() , history.begin() + extra);
-  }
+  history_trim();
 
   size_t after = history.size();
   return (after > before) ? (after - before) : 0;
 
 } 
 
-//write history file (overwrite)
-bool history_write_file(const std::string& path){
-  std::ofstream out(path , std::ios::trunc);
-  if(!out.is_open()) return false;
-
-  for(auto& cmd : history){
-    out << cmd << std::endl;
+//opens the history file under an exclusive flock. The file the lock was taken on must
+//still be the one at path: a compaction may have renamed a new file over it meanwhile
+static int histfile_lock(const std::string& path, int flags){
+  for(int tries = 0; tries < 8; tries++){
+    int fd = open(path.c_str(), flags | O_CLOEXEC, 0600);
+    if(fd < 0) return -1;
+    if(flock(fd, LOCK_EX) < 0){
+      close(fd);
+      return -1;
+    }
+    struct stat held, now;
+    if(fstat(fd, &held) == 0 && stat(path.c_str(), &now) == 0 &&
+       held.st_dev == now.st_dev && held.st_ino == now.st_ino){
+      return fd;
+    }
+    close(fd);
   }
-
-  return true;
+  return -1;
 }
 
 //appending new command on exit
 bool history_append_file (const std::string& path , size_t from_index){
-  if(from_index > history.size()){
+  if(from_index >= history.size()){
     return true;
   }
 
-  std::ofstream out(path, std::ios::app);
-  if(!out.is_open()) return false;
-
+  std::string data;
   for (size_t i = from_index; i < history.size(); ++i){
-    out << history[i] << std::endl;
+    data += atom_view(history[i]);
+    data += '\n';
+  }
+
+  int fd = histfile_lock(path, O_WRONLY | O_CREAT | O_APPEND);
+  if(fd < 0) return false;
+  bool ok = write_all(fd, data.data(), data.size());
+  close(fd);
+  return ok;
+}
+
+//the history file is rewritten once it grows past this, or at every exit under erasedups
+constexpr off_t HISTFILE_COMPACT_BYTES = 256 * 1024;
+
+//with the file's lock held: data goes to a temp file that is renamed over path
+static bool history_rename_over(const std::string& path, const std::string& data){
+  std::string tmp = path + ".compact." + std::to_string(getpid());
+  int tfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  bool ok = tfd >= 0 && write_all(tfd, data.data(), data.size()) && fdatasync(tfd) == 0;
+  if(tfd >= 0) close(tfd);
+  if(!ok || rename(tmp.c_str(), path.c_str()) < 0){
+    unlink(tmp.c_str());
+    return false;
   }
   return true;
 }
 
-std::vector<std::string> builtins = { "exit" , "echo" , "type", "pwd", "cd", "history"};
+//rewrites the history file with its last HISTORY_LIMIT lines (deduplicated under
+//HISTCONTROL) into a temp file that is renamed over it, so readers and appenders
+//always see a whole file
+static void history_compact_file(const std::string& path, int hc){
+  int fd = histfile_lock(path, O_RDWR);
+  if(fd < 0) return;
+
+  std::string data;
+  char buf[64 * 1024];
+  ssize_t n;
+  while((n = read(fd, buf, sizeof(buf))) > 0) data.append(buf, n);
+
+  std::vector<std::string_view> lines;
+  size_t pos = 0;
+  while(pos < data.size()){
+    size_t nl = data.find('\n', pos);
+    if(nl == std::string::npos) nl = data.size();
+    if(nl > pos) lines.emplace_back(data.data() + pos, nl - pos);
+    pos = nl + 1;
+  }
+
+  //keep the newest copy of each line, walking from the end
+  std::vector<std::string_view> kept;
+  std::unordered_set<std::string_view> seen;
+  for(size_t i = lines.size(); i-- > 0 && kept.size() < HISTORY_LIMIT;){
+    if((hc & HC_ERASEDUPS) && !seen.insert(lines[i]).second) continue;
+    if((hc & HC_IGNOREDUPS) && !kept.empty() && kept.back() == lines[i]) continue;
+    kept.push_back(lines[i]);
+  }
+
+  std::string out;
+  for(size_t i = kept.size(); i-- > 0;){
+    out += kept[i];
+    out += '\n';
+  }
+
+  history_rename_over(path, out);
+  close(fd);   //appenders waiting on the old file notice the rename and reopen
+}
+
+//write history file (overwrite), -c and -w: the same locked rename as a compaction
+bool history_write_file(const std::string& path, bool empty){
+  std::string data;
+  if(!empty){
+    for(atom_t cmd : history){
+      data += atom_view(cmd);
+      data += '\n';
+    }
+  }
+
+  int fd = histfile_lock(path, O_RDONLY | O_CREAT);
+  if(fd < 0) return false;
+  bool ok = history_rename_over(path, data);
+  close(fd);
+  return ok;
+}
+
+//compacts in a forked child so neither the prompt nor the exit waits for it
+static void history_compact_async(const std::string& path){
+  int hc = histcontrol();
+  struct stat st;
+  if(stat(path.c_str(), &st) < 0) return;
+  if(st.st_size <= HISTFILE_COMPACT_BYTES && !(hc & HC_ERASEDUPS)) return;
+
+  pid_t pid = fork();
+  if(pid == 0){
+    //a grandchild does the work, so nobody has to wait for it
+    if(fork() == 0){
+      history_compact_file(path, hc);
+    }
+    _exit(0);
+  }
+  if(pid > 0) waitpid(pid, nullptr, 0);
+}
+
+//writes this session's history on exit
+static void history_save(){
+  if constexpr (HIST_MODE == histpersistence::APPEND){
+    history_append_file(HISTFILE, session_start_index);
+  }
+  else {
+    history_write_file(HISTFILE, false);
+  }
+  history_compact_async(HISTFILE);
+}
+
+std::vector<std::string> builtins = { "exit" , "echo" , "type", "pwd", "cd", "history", "export", "unset", "set",
+                                      "break", "continue", "return", "local", "shift", "builtin",
+                                      "xargs"};
+
+//in-process text utilities, used under `set -o fastutils` or through `builtin`
+static const char* const fastutils[] = {"grep", "wc", "head"};
+
+static bool is_fastutil(const std::string& name){
+  for(auto f : fastutils){
+    if(name == f) return true;
+  }
+  return false;
+}
 
 bool is_Builtin(std::string command){
   for(const auto& builtin : builtins){
@@ -144,53 +664,234 @@ static std::vector<std::string> split_path_env (const std::string& path_env){
   return dirs;
 }
 
+//on-disk snapshot of the PATH listing, so a new shell does not rescan directories that
+//did not change. Layout (native endianness, the version bumps on any change):
+//  "SHPC" u32 version, u32 dir count, then per dir:
+//  u32 path length, path, u64 dev, u64 ino, i64 mtime sec, i64 mtime nsec,
+//  u32 name count, then per name u32 length and the name
+constexpr uint32_t PATH_SNAPSHOT_VERSION = 1;
+
+struct path_dir_entry {
+  std::string dir;
+  uint64_t dev = 0, ino = 0;
+  int64_t mtime_sec = 0, mtime_nsec = 0;
+  std::vector<atom_t> names;        //executables, in directory order, one reference each
+  bool fresh = false;               //scanned now rather than taken from the snapshot
+};
+
+static std::string path_snapshot_file(){
+  const char* xdg = var_cstr("XDG_CACHE_HOME");
+  if(xdg && *xdg) return std::string(xdg) + "/shell/path_cache";
+  const char* home = var_cstr("HOME");
+  if(home && *home) return std::string(home) + "/.cache/shell/path_cache";
+  return {};
+}
+
+//maps the snapshot and returns its directories, empty when missing or of another version
+static std::unordered_map<std::string, path_dir_entry> path_snapshot_load(const std::string& file){
+  std::unordered_map<std::string, path_dir_entry> out;
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return out;
+
+  struct stat st;
+  if(fstat(fd, &st) < 0 || st.st_size < 12){
+    close(fd);
+    return out;
+  }
+  size_t size = st.st_size;
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) return out;
+
+  const char* p = (const char*)map;
+  const char* end = p + size;
+  auto take = [&](void* dst, size_t n){
+    if((size_t)(end - p) < n) return false;
+    memcpy(dst, p, n);
+    p += n;
+    return true;
+  };
+  auto take_view = [&](std::string_view& dst){
+    uint32_t len;
+    if(!take(&len, sizeof(len)) || (size_t)(end - p) < len) return false;
+    dst = std::string_view(p, len);
+    p += len;
+    return true;
+  };
+
+  uint32_t version = 0, ndirs = 0;
+  bool ok = memcmp(p, "SHPC", 4) == 0;
+  p += 4;
+  ok = ok && take(&version, 4) && version == PATH_SNAPSHOT_VERSION && take(&ndirs, 4);
+  for(uint32_t d = 0; ok && d < ndirs; d++){
+    path_dir_entry e;
+    std::string_view dir, name;
+    uint32_t nnames = 0;
+    ok = take_view(dir) && take(&e.dev, 8) && take(&e.ino, 8) &&
+         take(&e.mtime_sec, 8) && take(&e.mtime_nsec, 8) && take(&nnames, 4);
+    e.dir = dir;
+    //names go from the mapping straight into the arena
+    for(uint32_t k = 0; ok && k < nnames; k++){
+      ok = take_view(name);
+      if(ok) e.names.push_back(atom_intern(name));
+    }
+    auto& slot = out[e.dir];
+    for(atom_t a : slot.names) atom_release(a);
+    slot = std::move(e);
+  }
+  munmap(map, size);
+  if(!ok){
+    for(auto& [dir, e] : out){
+      for(atom_t a : e.names) atom_release(a);
+    }
+    out.clear();
+  }
+  return out;
+}
+
+//writes the snapshot next to its final name and renames it over, so readers never see half of it
+static void path_snapshot_save(const std::string& file, const std::vector<path_dir_entry>& dirs){
+  std::string data("SHPC", 4);
+  auto put = [&](const void* src, size_t n){ data.append((const char*)src, n); };
+  auto put_str = [&](std::string_view str){
+    uint32_t len = str.size();
+    put(&len, 4);
+    data += str;
+  };
+
+  uint32_t version = PATH_SNAPSHOT_VERSION, ndirs = 0;
+  put(&version, 4);
+  size_t count_at = data.size();
+  put(&ndirs, 4);
+
+  //a directory modified in the last two seconds could change again within the same
+  //mtime tick, so it is left out and rescanned next time
+  int64_t now = time(nullptr);
+  for(auto& e : dirs){
+    if(e.ino == 0 || e.mtime_sec >= now - 2) continue;
+    put_str(e.dir);
+    put(&e.dev, 8);
+    put(&e.ino, 8);
+    put(&e.mtime_sec, 8);
+    put(&e.mtime_nsec, 8);
+    uint32_t nnames = e.names.size();
+    put(&nnames, 4);
+    for(atom_t n : e.names) put_str(atom_view(n));
+    ndirs++;
+  }
+  memcpy(&data[count_at], &ndirs, 4);
+
+  std::error_code ec;
+  fs::create_directories(fs::path(file).parent_path(), ec);
+  std::string tmp = file + "." + std::to_string(getpid());
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if(fd < 0) return;   //read-only home or cache dir: just keep scanning
+  bool ok = write_all(fd, data.data(), data.size());
+  close(fd);
+  if(!ok || rename(tmp.c_str(), file.c_str()) < 0) unlink(tmp.c_str());
+}
+
+static void scan_path_dir(path_dir_entry& e){
+  e.fresh = true;
+  e.names.clear();
+  try {
+    for(const auto& entry : fs::directory_iterator(e.dir)){
+      if(!entry.is_regular_file()) continue;
+
+      auto p = entry.path();
+      std::string name = p.filename().string();
+      if(!name.empty() && name[0] == '.') continue;
+      std::string full = p.string();
+      if(access(full.c_str() , X_OK) != 0) continue;
+
+      e.names.push_back(atom_intern(name));
+    }
+  }
+  catch(...) {
+    //unreadable dirs
+  }
+}
+
 static void rebuild_path_exec_cache(){
-  const char* env = getenv("PATH");
+  const char* env = var_cstr("PATH");
   std::string cur = env ? std::string(env) : std::string();
 
   if(cur == cached_path_env && path_cache_built) return;
 
   cached_path_env = cur;
+  std::vector<atom_t> old_cache = std::move(path_exec_cache);
   path_exec_cache.clear();
   path_cache_built= true;
+  path_cache_generation++;
+
+  //directories whose dev, inode and mtime match the snapshot reuse its listing
+  std::string snapshot = path_snapshot_file();
+  auto known = path_snapshot_load(snapshot);
+
+  std::vector<path_dir_entry> dirs;
+  bool changed = false;
+  for(auto& dir : split_path_env(cur)){
+    path_dir_entry e;
+    e.dir = dir;
+    struct stat st;
+    if(stat(dir.c_str(), &st) == 0){
+      e.dev = st.st_dev;
+      e.ino = st.st_ino;
+      e.mtime_sec = st.st_mtim.tv_sec;
+      e.mtime_nsec = st.st_mtim.tv_nsec;
+    }
 
-  std::unordered_set<std::string> seen;
-  auto dirs = split_path_env(cur);
-
-  for(const auto& dir : dirs){
-    try {
-      for(const auto& entry : fs::directory_iterator(dir)){
-        if(!entry.is_regular_file()) continue;
+    auto it = known.find(dir);
+    if(e.ino != 0 && it != known.end() && it->second.dev == e.dev && it->second.ino == e.ino &&
+       it->second.mtime_sec == e.mtime_sec && it->second.mtime_nsec == e.mtime_nsec){
+      e.names = std::move(it->second.names);
+      it->second.names.clear();
+    }
+    else if(e.ino != 0){
+      scan_path_dir(e);
+      changed = true;
+    }
+    dirs.push_back(std::move(e));
+  }
 
-        auto p = entry.path();
-        std::string name = p.filename().string();
-        if(!name.empty() && name[0] == '.') continue;
-        std::string full = p.string();
-        if(access(full.c_str() , X_OK) != 0) continue;
-        
-        if(seen.insert(name).second){
-          path_exec_cache.push_back(name);
-        }
+  //atoms are unique per string, so duplicates are found by id
+  std::vector<bool> seen(atoms.entries.size());
+  for(auto& e : dirs){
+    for(atom_t name : e.names){
+      if(!seen[name]){
+        seen[name] = true;
+        atom_retain(name);
+        path_exec_cache.push_back(name);
+        std::string_view nv = atom_view(name);
+        command_hash.emplace(std::string(nv), e.dir + "/" + std::string(nv));   //first hit in PATH order wins
       }
     }
-    catch(...) {
-      //unreadable dirs
-    }
   }
+
+  if(changed && !snapshot.empty()) path_snapshot_save(snapshot, dirs);
+
+  for(auto& e : dirs){
+    for(atom_t a : e.names) atom_release(a);
+  }
+  for(auto& [dir, e] : known){
+    for(atom_t a : e.names) atom_release(a);
+  }
+  for(atom_t a : old_cache) atom_release(a);
 }
 
-//readline generator
+//readline generator: the pool is sorted, so the matches are one run found by binary search
 static char* completion_generator(const char* text, int state){
   static size_t idx =0;
-  if(state == 0) idx = 0;
+  std::string_view pref = text ? text : "";
 
-  std::string pref = text? std::string(text) : std::string();
+  if(state == 0){
+    idx = std::lower_bound(completion_pool.begin(), completion_pool.end(), pref,
+                           [](atom_t a, std::string_view p){ return atom_view(a) < p; })
+          - completion_pool.begin();
+  }
 
-  while (idx < completion_pool.size()){
-    const std::string& cand = completion_pool[idx++];
-    if(starts_with(cand, pref)){
-      return strdup(cand.c_str());
-    }
+  if(idx < completion_pool.size() && atom_view(completion_pool[idx]).starts_with(pref)){
+    return strdup(atom_cstr(completion_pool[idx++]));
   }
   return nullptr;
 }
@@ -203,21 +904,29 @@ static char** shell_completion(const char* text , int start, int end){
 
 
   if(start ==  0 || only_spaces_befor_start(start)){
-    completion_pool.clear();
-
-    std::unordered_set<std::string> seen;
-
-    for(auto& b : builtins) {
-      if(seen.insert(b).second) completion_pool.push_back(b);
-    }
-
+    startup_sync();
     rebuild_path_exec_cache();
 
-    for(auto& e : path_exec_cache){ 
-      if(seen.insert(e).second) completion_pool.push_back(e);
-    }
+    //the pool only changes with the PATH cache
+    if(completion_generation != path_cache_generation || completion_pool.empty()){
+      static std::vector<atom_t> builtin_atoms;
+      if(builtin_atoms.empty()){
+        for(auto& b : builtins) builtin_atoms.push_back(atom_intern(b));
+      }
 
-    std::sort(completion_pool.begin(), completion_pool.end());
+      completion_pool.clear();
+      std::vector<bool> seen(atoms.entries.size());
+      for(auto* list : {&builtin_atoms, &path_exec_cache}){
+        for(atom_t a : *list){
+          if(seen[a]) continue;
+          seen[a] = true;
+          completion_pool.push_back(a);
+        }
+      }
+      std::sort(completion_pool.begin(), completion_pool.end(),
+                [](atom_t a, atom_t b){ return atom_view(a) < atom_view(b); });
+      completion_generation = path_cache_generation;
+    }
     return rl_completion_matches(text, completion_generator);
   }
 
@@ -230,8 +939,8 @@ static void init_readline_completion(){
 
 struct Redirection {
   int fd;
-  std::string filename;
-  enum { TRUNC, APPEND, READ} mode;
+  std::string filename;   //the data itself for HEREDOC and HERESTRING
+  enum { TRUNC, APPEND, READ, HEREDOC, HERESTRING} mode;
 };
 
 struct FDSave{
@@ -256,6 +965,165 @@ void restorFD(const FDSave& s){
 
 }
 
+//finds the ')' or '}' that closes the "$(" or "${" whose bracket sits at open, skipping quoted text
+static size_t find_subst_end(const std::string& s, size_t open){
+  const char o = s[open];
+  const char cl = (o == '(') ? ')' : '}';
+  int depth = 0;
+  char q = 0;
+
+  for(size_t i = open; i < s.size(); i++){
+    char c = s[i];
+
+    if(q == '\''){
+      if(c == '\'') q = 0;
+      continue;
+    }
+    if(c == '\\'){
+      i++;
+      continue;
+    }
+    if(q == '"'){
+      if(c == '"') q = 0;
+      continue;
+    }
+    if(c == '\'' || c == '"'){
+      q = c;
+      continue;
+    }
+
+    if(c == o){
+      depth++;
+    }
+    else if(c == cl && --depth == 0){
+      return i;
+    }
+  }
+  return std::string::npos;
+}
+
+//finds the closing backtick, backslash escapes the next char
+static size_t find_backtick_end(const std::string& s, size_t open){
+  for(size_t i = open + 1; i < s.size(); i++){
+    if(s[i] == '\\'){
+      i++;
+      continue;
+    }
+    if(s[i] == '`') return i;
+  }
+  return std::string::npos;
+}
+
+static bool tokenizer_needs_more = false;
+//what was still open at the end of the input ("quotes", "command substitution"), or null
+static const char* tokenizer_unclosed = nullptr;
+//the first heredoc whose delimiter line has not been read yet
+static std::string tokenizer_heredoc_delim;
+static bool tokenizer_heredoc_strip = false;
+
+//heredoc operator still waiting for its body, op is the operator's token index
+struct heredoc_pending {
+  size_t op;
+  bool strip_tabs;
+};
+
+//delimiter with quoting removed, any quoting turns off expansion of the body
+static std::string heredoc_delim(const std::string& raw, bool& quoted){
+  std::string d;
+  quoted = false;
+  for(size_t i = 0; i < raw.size(); i++){
+    char c = raw[i];
+    if(c == '\'' || c == '"'){
+      quoted = true;
+      continue;
+    }
+    if(c == '\\'){
+      quoted = true;
+      if(i + 1 < raw.size()) d += raw[++i];
+      continue;
+    }
+    d += c;
+  }
+  return d;
+}
+
+//wraps a body so expand_word() yields it as one word: single quoted when literal,
+//double quoted (with '"' escaped) when $ and ` have to be expanded
+static std::string heredoc_word(const std::string& body, bool expand){
+  std::string w;
+  w.reserve(body.size() + 2);
+
+  if(!expand){
+    w += '\'';
+    for(char c : body){
+      if(c == '\'') w += "'\\''";
+      else w += c;
+    }
+    w += '\'';
+    return w;
+  }
+
+  w += '"';
+  for(size_t i = 0; i < body.size(); i++){
+    char c = body[i];
+    if(c == '"'){
+      w += "\\\"";
+    }
+    else if(c == '\\' && i + 1 < body.size() && body[i+1] == '"'){
+      w += "\\\\";
+    }
+    else{
+      w += c;
+    }
+  }
+  w += '"';
+  return w;
+}
+
+//reads the bodies of pending heredocs from the lines after pos (a newline or the end
+//of cmd), replaces each delimiter token with its body and returns the last index consumed
+static size_t collect_heredocs(const std::string& cmd, size_t pos, std::vector<std::string>& tokens, std::vector<heredoc_pending>& pending){
+  size_t at = std::min(pos + 1, cmd.size());
+
+  for(auto& h : pending){
+    if(h.op + 1 >= tokens.size()) continue;   //missing delimiter, RD_tokens reports it
+
+    bool quoted = false;
+    std::string delim = heredoc_delim(tokens[h.op + 1], quoted);
+    std::string body;
+    bool found = false;
+
+    while(at < cmd.size()){
+      size_t nl = cmd.find('\n', at);
+      size_t end = (nl == std::string::npos) ? cmd.size() : nl;
+      std::string_view line(cmd.data() + at, end - at);
+      at = (nl == std::string::npos) ? cmd.size() : nl + 1;
+
+      if(h.strip_tabs){
+        while(!line.empty() && line[0] == '\t') line.remove_prefix(1);
+      }
+      if(line == delim){
+        found = true;
+        break;
+      }
+      body.append(line);
+      body += '\n';
+    }
+
+    if(!found && !tokenizer_needs_more){
+      tokenizer_needs_more = true;
+      tokenizer_heredoc_delim = delim;
+      tokenizer_heredoc_strip = h.strip_tabs;
+    }
+    tokens[h.op] = "<<";
+    tokens[h.op + 1] = heredoc_word(body, !quoted);
+  }
+
+  pending.clear();
+  return at - 1;
+}
+
+//tokens keep their raw spelling (quotes, escapes, substitutions), expand_words() interprets them
 std::vector<std::string> tokenizer(std::string cmd){
 
     std::vector<std::string> tokens;
@@ -265,6 +1133,9 @@ std::vector<std::string> tokenizer(std::string cmd){
     bool escape = false;
     char quote_char = 0;
 
+    std::vector<heredoc_pending> heredocs;
+    tokenizer_needs_more = false;
+    tokenizer_unclosed = nullptr;
 
     for (size_t i = 0 ; i < cmd.size() ; i++){  //loop is changed to interating because in range loop its not possible to peek
       char c = cmd[i];
@@ -277,34 +1148,37 @@ std::vector<std::string> tokenizer(std::string cmd){
       }
 
       if ( !in_quotes && c == '\\'){
+        current += c;
         escape = true;
         continue;
       }
 
+      //substitutions are copied verbatim, they run at expansion time
+      if((!in_quotes || quote_char == '"') && (c == '`' || (c == '$' && i + 1 < cmd.size() && (cmd[i+1] == '(' || cmd[i+1] == '{')))){
+        size_t end = (c == '`') ? find_backtick_end(cmd, i) : find_subst_end(cmd, i + 1);
+        if(end == std::string::npos){
+          tokenizer_unclosed = "command substitution";
+          return {};
+        }
+        current.append(cmd, i, end - i + 1);
+        i = end;
+        continue;
+      }
+
       //inside double quote
       if( in_quotes && quote_char == '"'){
 
         if(c == '\\'){
+          current += c;
           if( i + 1 < cmd.size()){
-            char next = cmd[i+1];
-            if ( next == '"' || next == '\\'){
-              current += next;
-              i++;
-            }
-            else{
-              current += '\\';
-            }
-          }
-          else {
-            current += '\\';
+            current += cmd[i+1];
+            i++;
           }
-
           continue;
         }
 
         if (c == '"'){
           in_quotes = false;
-          continue;
         }
 
         current += c;
@@ -316,9 +1190,7 @@ std::vector<std::string> tokenizer(std::string cmd){
         if (c == quote_char){
           in_quotes = false;
         }
-        else{
-          current += c;
-        }
+        current += c;
         continue;
       }
 
@@ -326,6 +1198,7 @@ std::vector<std::string> tokenizer(std::string cmd){
       if (c == '"' || c == '\'' ){
         in_quotes = true;
         quote_char = c;
+        current += c;
         continue;
       }
 
@@ -334,7 +1207,26 @@ std::vector<std::string> tokenizer(std::string cmd){
           tokens.push_back(current);
           current.clear();
         }  
-        tokens.push_back("|");
+        if(i+1 < cmd.size() && cmd[i+1] == '|'){
+          tokens.push_back("||");
+          i++;
+        }else{
+          tokens.push_back("|");
+        }
+        continue;
+      }
+
+      if (!in_quotes && (c == ';' || c == '(' || c == ')' || (c == '&' && i+1 < cmd.size() && cmd[i+1] == '&'))){
+        if(!current.empty()){
+          tokens.push_back(current);
+          current.clear();
+        }
+        if(c == '&'){
+          tokens.push_back("&&");
+          i++;
+        }else{
+          tokens.push_back(std::string(1,c));
+        }
         continue;
       }
 
@@ -348,6 +1240,14 @@ std::vector<std::string> tokenizer(std::string cmd){
         if (c == '>' && i+1 < cmd.size() && cmd[i+ 1] == '>') {
           tokens.push_back(">>");
           i++;
+        }else if (c == '<' && i+2 < cmd.size() && cmd[i+1] == '<' && cmd[i+2] == '<') {
+          tokens.push_back("<<<");
+          i += 2;
+        }else if (c == '<' && i+1 < cmd.size() && cmd[i+1] == '<') {
+          bool strip = i+2 < cmd.size() && cmd[i+2] == '-';
+          heredocs.push_back({tokens.size(), strip});
+          tokens.push_back(strip ? "<<-" : "<<");
+          i += strip ? 2 : 1;
         }else{
           tokens.push_back(std::string(1,c));
         }
@@ -376,6 +1276,15 @@ std::vector<std::string> tokenizer(std::string cmd){
           tokens.push_back(current);
           current.clear();
         }
+        //a newline ends a command like ';', heredoc bodies start on the line after the operator
+        if(c == '\n'){
+          if(!tokens.empty() && tokens.back() != "\n"){
+            tokens.push_back("\n");
+          }
+          if(!heredocs.empty()){
+            i = collect_heredocs(cmd, i, tokens, heredocs);
+          }
+        }
         continue;
       }
 
@@ -384,13 +1293,8 @@ std::vector<std::string> tokenizer(std::string cmd){
 
     }
 
-    //trailing backslash outside quotes
-    if (escape) {
-        current += '\\';
-    }
-
     if (in_quotes){
-      std::cerr <<  "error : unclosed quotes"<< std::endl;
+      tokenizer_unclosed = "quotes";
       return {};
     }
 
@@ -398,393 +1302,3197 @@ std::vector<std::string> tokenizer(std::string cmd){
       tokens.push_back(current);
     }
 
+    if(!heredocs.empty()){
+      collect_heredocs(cmd, cmd.size(), tokens, heredocs);
+    }
+
     return tokens;
 } 
 
-std::pair< std::vector<std::string>, std::vector<Redirection> > RD_tokens (const std::vector<std::string>& tokens){
+//directory contents read with getdents64, names packed into one buffer
+struct dir_listing {
+  struct entry {
+    uint32_t off;
+    uint32_t len;
+    unsigned char type;   //d_type, DT_UNKNOWN on filesystems that do not fill it
+  };
+
+  std::string names;
+  std::vector<entry> entries;
+  dev_t dev = 0;
+  ino_t ino = 0;
+  struct timespec mtime {};
+
+  std::string_view name(const entry& e) const {
+    return std::string_view(names.data() + e.off, e.len);
+  }
+};
 
-  std::vector<std::string> argv_tokens;
-  std::vector<Redirection> redirs;
-  
-  
-  size_t i = 0;
+//listings read while expanding the current line, revalidated against the dir's inode and mtime
+static std::unordered_map<std::string, std::shared_ptr<const dir_listing>> glob_dir_cache;
+static std::mutex glob_cache_mu;
 
-  while (i < tokens.size()){
+static constexpr size_t GETDENTS_BUF = 256 * 1024;
 
-    const std::string& tok = tokens[i];
+static void glob_cache_clear(){
+  std::lock_guard<std::mutex> lk(glob_cache_mu);
+  glob_dir_cache.clear();
+}
 
-    if (tok == ">" || tok == "1>" || tok == ">>" || tok == "<" || tok == "2>" || tok == "2>>" || tok == "1>>"){
+static std::shared_ptr<const dir_listing> read_dir_listing(const std::string& dir){
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if(fd < 0) return nullptr;
 
-      if (i + 1 == tokens.size()){
-        throw std::runtime_error("missing filename");
+  struct stat st;
+  if(fstat(fd, &st) < 0){
+    close(fd);
+    return nullptr;
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(glob_cache_mu);
+    auto it = glob_dir_cache.find(dir);
+    if(it != glob_dir_cache.end()){
+      const dir_listing& c = *it->second;
+      if(c.dev == st.st_dev && c.ino == st.st_ino && c.mtime.tv_sec == st.st_mtim.tv_sec && c.mtime.tv_nsec == st.st_mtim.tv_nsec){
+        close(fd);
+        return it->second;
       }
+    }
+  }
 
-      Redirection redir;
+  auto l = std::make_shared<dir_listing>();
+  l->dev = st.st_dev;
+  l->ino = st.st_ino;
+  l->mtime = st.st_mtim;
 
-      if (tok.size() >= 2 && tok[0] == '2' && tok[1] == '>' ){
-        redir.fd = 2;
-      }
-      else if( tok == "<"){
-        redir.fd = 0;
-      }
-      else {
-        redir.fd = 1;
-      }
+  thread_local std::unique_ptr<char[]> buf(new char[GETDENTS_BUF]);
+  while(true){
+    long n = syscall(SYS_getdents64, fd, buf.get(), GETDENTS_BUF);
+    if(n <= 0) break;
 
+    for(long off = 0; off < n; ){
+      auto* d = reinterpret_cast<struct dirent64*>(buf.get() + off);
+      off += d->d_reclen;
 
-      if  (tok == ">" || tok == "1>" || tok == "2>"){
-        redir.mode = Redirection::TRUNC;
-      }
-      else if (tok == ">>" || tok == "2>>" || tok == "1>>"){
-        redir.mode = Redirection::APPEND;
-      }
-      else if (tok == "<"){
-        redir.mode = Redirection::READ;
-      }
+      const char* nm = d->d_name;
+      if(nm[0] == '.' && (nm[1] == '\0' || (nm[1] == '.' && nm[2] == '\0'))) continue;
 
-      redir.filename = tokens[i+1];
+      size_t len = strlen(nm);
+      l->entries.push_back({(uint32_t)l->names.size(), (uint32_t)len, d->d_type});
+      l->names.append(nm, len);
+    }
+  }
+  close(fd);
 
-      redirs.push_back(redir);
+  std::lock_guard<std::mutex> lk(glob_cache_mu);
+  glob_dir_cache[dir] = l;
+  return l;
+}
 
-      i+= 2;
-      continue;
+//[:name:] inside a bracket expression; false for names POSIX does not define
+static bool glob_class(std::string_view name, unsigned char ch, bool& hit){
+  static const std::pair<std::string_view, int(*)(int)> classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+  };
+  for(auto& [n, fn] : classes){
+    if(n == name){
+      if(fn(ch)) hit = true;
+      return true;
     }
-    else{
-      argv_tokens.push_back(tok);
-      ++i;
+  }
+  return false;
+}
+
+//matches one char of p at pi against ch ('?', '[...]', '\x' or a literal), sets next
+static bool glob_match_one(std::string_view p, size_t pi, char ch, size_t& next){
+  char c = p[pi];
+
+  if(c == '?'){
+    next = pi + 1;
+    return true;
+  }
+
+  if(c == '['){
+    size_t j = pi + 1;
+    bool negate = j < p.size() && (p[j] == '!' || p[j] == '^');
+    if(negate) j++;
+
+    bool hit = false;
+    bool first = true;
+    bool valid = true;
+    while(j < p.size() && (p[j] != ']' || first)){
+      first = false;
+      if(p[j] == '[' && j + 1 < p.size() && p[j+1] == ':'){
+        size_t end = p.find(":]", j + 2);
+        if(end != std::string_view::npos){
+          //an unknown class makes the whole bracket an ordinary '['
+          if(!glob_class(p.substr(j + 2, end - j - 2), (unsigned char)ch, hit)){
+            valid = false;
+            break;
+          }
+          j = end + 2;
+          continue;
+        }
+      }
+      char lo = p[j];
+      if(lo == '\\' && j + 1 < p.size()) lo = p[++j];
+      char hi = lo;
+      if(j + 2 < p.size() && p[j+1] == '-' && p[j+2] != ']'){
+        j += 2;
+        hi = p[j];
+        if(hi == '\\' && j + 1 < p.size()) hi = p[++j];
+      }
+      if((unsigned char)ch >= (unsigned char)lo && (unsigned char)ch <= (unsigned char)hi) hit = true;
+      j++;
     }
 
+    if(valid && j < p.size()){
+      next = j + 1;
+      return hit != negate;
+    }
+    //no closing ']' or an unknown class, the '[' is an ordinary char
   }
 
-  return { argv_tokens, redirs};
+  if(c == '\\' && pi + 1 < p.size()){
+    next = pi + 2;
+    return p[pi+1] == ch;
+  }
 
+  next = pi + 1;
+  return c == ch;
 }
 
-bool RD_apply( const std::vector<Redirection>& redirs, bool in_child){
+//wildcard match that backtracks only to the last '*'
+static bool glob_match(std::string_view p, std::string_view s){
+  size_t pi = 0, si = 0;
+  size_t star_p = std::string_view::npos, star_s = 0;
 
-  for( const auto& r : redirs){
+  while(si < s.size()){
+    if(pi < p.size()){
+      if(p[pi] == '*'){
+        star_p = ++pi;
+        star_s = si;
+        continue;
+      }
+      size_t next;
+      if(glob_match_one(p, pi, s[si], next)){
+        pi = next;
+        si++;
+        continue;
+      }
+    }
+    if(star_p == std::string_view::npos) return false;
+    pi = star_p;
+    si = ++star_s;
+  }
 
-    int fd;
+  while(pi < p.size() && p[pi] == '*') pi++;
+  return pi == p.size();
+}
 
-    if ( r.mode == Redirection::READ){
-      fd = open(r.filename.c_str(), O_RDONLY);
+//one path component of a pattern, compiled to the cheapest way of testing it
+struct glob_matcher {
+  enum kind_t { LITERAL, ALL, SUFFIX, PREFIX, GENERAL, GLOBSTAR } kind = LITERAL;
+  std::string lit;    //unescaped text for LITERAL, SUFFIX and PREFIX
+  std::string pat;    //escaped pattern for GENERAL
+  bool dot_ok = false;
+
+  bool match(std::string_view name) const {
+    if(name[0] == '.' && !dot_ok) return false;
+
+    switch(kind){
+      case LITERAL: return name == lit;
+      case ALL: return true;
+      case SUFFIX: return name.size() >= lit.size() && memcmp(name.data() + name.size() - lit.size(), lit.data(), lit.size()) == 0;
+      case PREFIX: return name.size() >= lit.size() && memcmp(name.data(), lit.data(), lit.size()) == 0;
+      case GENERAL: return glob_match(pat, name);
+      case GLOBSTAR: return true;
     }
-    else if(r.mode == Redirection::TRUNC){
-      fd = open(r.filename.c_str() , O_WRONLY | O_CREAT | O_TRUNC, 0644); //permission is set to 0644 (read/write for owners  and read for others)
+    return false;
+  }
+};
+
+static glob_matcher glob_compile(const std::string& comp){
+  glob_matcher m;
+  m.pat = comp;
+
+  if(comp == "**"){
+    m.kind = glob_matcher::GLOBSTAR;
+    return m;
+  }
+
+  //literal text around at most one leading or trailing '*' gets a fast path
+  std::string text;
+  int stars = 0;
+  bool lead = false, other = false;
+  for(size_t i = 0; i < comp.size(); i++){
+    char c = comp[i];
+    if(c == '\\' && i + 1 < comp.size()){
+      text += comp[++i];
+    }
+    else if(c == '*'){
+      stars++;
+      if(i == 0) lead = true;
+      else if(i + 1 != comp.size()) other = true;
+    }
+    else if(c == '?' || c == '['){
+      other = true;
     }
     else{
-      fd = open(r.filename.c_str() , O_WRONLY | O_CREAT | O_APPEND, 0644);
+      text += c;
     }
+  }
 
-    if(fd < 0){
-      perror(r.filename.c_str());
-      if(in_child) _exit(1);
-      return false;
+  m.lit = text;
+  m.dot_ok = !comp.empty() && (comp[0] == '.' || (comp[0] == '\\' && comp.size() > 1 && comp[1] == '.'));
+
+  if(other || stars > 1){
+    m.kind = glob_matcher::GENERAL;
+  }
+  else if(stars == 0){
+    m.kind = glob_matcher::LITERAL;
+  }
+  else if(comp.size() == 1){
+    m.kind = glob_matcher::ALL;
+  }
+  else{
+    m.kind = lead ? glob_matcher::SUFFIX : glob_matcher::PREFIX;
+  }
+
+  //a '[' without its ']' is still only a literal
+  if(m.kind == glob_matcher::GENERAL && stars == 0 && comp.find('?') == std::string::npos){
+    size_t next;
+    bool closed = false;
+    for(size_t i = 0; i < comp.size(); i = next){
+      if(comp[i] == '['){
+        glob_match_one(comp, i, '\0', next);
+        if(next != i + 1){
+          closed = true;
+          break;
+        }
+      }
+      else{
+        next = (comp[i] == '\\') ? i + 2 : i + 1;
+      }
     }
+    if(!closed) m.kind = glob_matcher::LITERAL;
+  }
+  return m;
+}
 
-    if(dup2(fd, r.fd) < 0) {
-        perror("dup2");
-        if(in_child) _exit(1);
-        return false;
+static std::string path_join(const std::string& dir, std::string_view name){
+  std::string p;
+  p.reserve(dir.size() + name.size() + 1);
+  p = dir;
+  if(!p.empty() && p.back() != '/') p += '/';
+  p.append(name);
+  return p;
+}
+
+//d_type is enough unless it is a symlink (followed) or the fs did not fill it
+static bool entry_is_dir(const std::string& path, unsigned char type, bool follow){
+  if(type == DT_DIR) return true;
+  if(type != DT_UNKNOWN && !(type == DT_LNK && follow)) return false;
+
+  struct stat st;
+  if(fstatat(AT_FDCWD, path.c_str(), &st, follow ? 0 : AT_SYMLINK_NOFOLLOW) < 0) return false;
+  return S_ISDIR(st.st_mode);
+}
+
+static constexpr unsigned GLOBSTAR_MAX_THREADS = 8;
+
+//every directory below root (root included) for '**', read by a small pool of
+//threads sharing one queue; symlinks and hidden dirs are not descended into
+static std::vector<std::string> globstar_dirs(const std::string& root){
+  std::mutex mu;
+  std::condition_variable cv;
+  std::deque<std::string> queue{root};
+  std::vector<std::string> found{root};
+  unsigned busy = 0;
+
+  auto worker = [&](){
+    std::unique_lock<std::mutex> lk(mu);
+    while(true){
+      cv.wait(lk, [&]{ return !queue.empty() || busy == 0; });
+      if(queue.empty()) return;
+
+      std::string dir = std::move(queue.front());
+      queue.pop_front();
+      busy++;
+      lk.unlock();
+
+      std::vector<std::string> subdirs;
+      if(auto l = read_dir_listing(dir.empty() ? "." : dir)){
+        for(auto& e : l->entries){
+          std::string_view nm = l->name(e);
+          if(nm[0] == '.') continue;
+          std::string sub = path_join(dir, nm);
+          if(entry_is_dir(sub, e.type, false)) subdirs.push_back(std::move(sub));
+        }
+      }
+
+      lk.lock();
+      for(auto& d : subdirs){
+        found.push_back(d);
+        queue.push_back(std::move(d));
+      }
+      busy--;
+      cv.notify_all();
     }
-    close(fd);
+  };
 
+  unsigned n = std::clamp(std::thread::hardware_concurrency(), 1u, GLOBSTAR_MAX_THREADS);
+  std::vector<std::thread> pool;
+  for(unsigned i = 1; i < n; i++){
+    pool.emplace_back(worker);
   }
-  return true;
+  worker();
+  for(auto& t : pool){
+    t.join();
+  }
+  return found;
 }
 
-struct command {
-  std::vector<std::string> argv;
-  std::vector<Redirection> redirs;
-  bool is_builtin = false;
-};
+static void glob_walk(const std::vector<glob_matcher>& comps, size_t ci, const std::string& path, bool dir_only, std::vector<std::string>& out){
+  const glob_matcher& m = comps[ci];
+  bool last = (ci + 1 == comps.size());
 
-std::vector<std::vector<std::string>> split_by_pipe (const std::vector<std::string>& tokens){
+  if(m.kind == glob_matcher::LITERAL){
+    std::string next = path_join(path, m.lit);
+    if(!last){
+      glob_walk(comps, ci + 1, next, dir_only, out);
+      return;
+    }
+    struct stat st;
+    if(fstatat(AT_FDCWD, next.c_str(), &st, dir_only ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && (!dir_only || S_ISDIR(st.st_mode))){
+      out.push_back(dir_only ? next + "/" : next);
+    }
+    return;
+  }
 
-  std::vector<std::vector<std::string>> parts;
-  std::vector<std::string> cur;
+  if(m.kind == glob_matcher::GLOBSTAR){
+    static const glob_matcher all = glob_compile("*");
+    std::vector<glob_matcher> rest(comps.begin() + ci + 1, comps.end());
+    if(rest.empty()) rest.push_back(all);
 
-  for (const auto& t : tokens){
-    if(t == "|"){
-      parts.push_back(cur);
-      cur.clear();
-    }
-    else {
-      cur.push_back(t);
+    for(auto& d : globstar_dirs(path)){
+      glob_walk(rest, 0, d, dir_only, out);
     }
+    return;
   }
 
-  parts.push_back(cur);
-  return parts;
+  auto l = read_dir_listing(path.empty() ? "." : path);
+  if(!l) return;
 
-}
+  for(auto& e : l->entries){
+    std::string_view nm = l->name(e);
+    if(!m.match(nm)) continue;
 
-std::vector<command> parse_pipeline (const std::vector<std::string>& tokens){
-  auto parts = split_by_pipe(tokens);
+    std::string next = path_join(path, nm);
+    if(last && !dir_only){
+      out.push_back(std::move(next));
+      continue;
+    }
+    if(!entry_is_dir(next, e.type, true)) continue;
 
-  for(size_t i = 0; i < parts.size(); i++){
-    if (parts[i].empty()) {
-      throw std::runtime_error("syntax error near unexpected token `|`");
+    if(last){
+      out.push_back(next + "/");
+    }
+    else{
+      glob_walk(comps, ci + 1, next, dir_only, out);
     }
   }
+}
 
-  std::vector<command> cmds;
-  cmds.reserve(parts.size());
+//expands an escaped pattern into sorted matching paths, false when it matches nothing
+static bool glob_expand(const std::string& pattern, std::vector<std::string>& out){
+  std::vector<glob_matcher> comps;
+  bool has_meta = false;
 
-  for(auto & seg : parts){
-    auto [argv_str, redirs] = RD_tokens(seg);
-    if(argv_str.empty()){
-      throw std::runtime_error("syntax error: empty command in pipeline");
-    }
+  size_t i = 0;
+  std::string root;
+  if(!pattern.empty() && pattern[0] == '/'){
+    root = "/";
+    i = 1;
+  }
 
-    command c;
-    c.argv = std::move(argv_str);
-    c.redirs = std::move(redirs);
-    c.is_builtin = is_Builtin(c.argv[0]);
-    cmds.push_back(std::move(c));
+  bool dir_only = !pattern.empty() && pattern.back() == '/';
+  while(i < pattern.size()){
+    size_t j = pattern.find('/', i);
+    if(j == std::string::npos) j = pattern.size();
+    if(j > i){
+      comps.push_back(glob_compile(pattern.substr(i, j - i)));
+      if(comps.back().kind != glob_matcher::LITERAL) has_meta = true;
+    }
+    i = j + 1;
   }
 
-  return cmds;
+  if(!has_meta) return false;
+
+  size_t before = out.size();
+  glob_walk(comps, 0, root, dir_only, out);
+  std::sort(out.begin() + before, out.end());
+  return out.size() > before;
 }
 
-int run_builtin(const std::vector<std::string>& argv, bool in_child){
+struct node;
+std::shared_ptr<const node> parse_shared(const std::vector<std::string>& tokens);
+int exec_node(const node& n);
 
-  (void)in_child;
-  if(argv.empty()) return 0;
-  const std::string & cmd = argv[0];
+static constexpr size_t CAPTURE_CHUNK = 64 * 1024;
 
-  if(cmd == "exit"){
-    return 0;
-  }
+static bool is_control_token(const std::string& t){
+  return t == "|" || t == "||" || t == "&&" || t == ";" || t == "\n" || t == "(" || t == ")";
+}
 
-  else if(cmd == "pwd"){
-    try{
-      fs::path currentPath = fs::current_path();
-      std::cout << currentPath.string() << std::endl;
-    }
-    catch (const fs::filesystem_error & e) {
-      std::cerr << "filesystem error : " << e.what() << std::endl;
-      return 1;
-    }
-    return 0;
+//exit code the way $? reports it: 128 + signal for killed processes
+static int status_code(int st){
+  if(WIFEXITED(st)) return WEXITSTATUS(st);
+  if(WIFSIGNALED(st)) return 128 + WTERMSIG(st);
+  return 1;
+}
+
+static bool is_function(std::string_view name);
+
+//builtins that only print can be captured without forking
+static bool capture_in_process(const std::vector<std::string>& tokens){
+  for(auto& t : tokens){
+    if(is_control_token(t)) return false;
   }
 
-  else if (cmd == "echo") {
-    for( size_t i = 1 ; i < argv.size() ; ++i){
-            std::cout << argv[i];
-            if(i + 1 < argv.size()){
-              std::cout << " ";
-            }
+  const std::string& cmd = tokens[0];
+  if(cmd == "echo" || cmd == "pwd" || cmd == "type") return true;
+  return cmd == "history" && (tokens.size() == 1 || tokens[1][0] != '-');
+}
+
+//reads fd until EOF, growing the string a chunk at a time
+static void read_all(int fd, std::string& out){
+  while(true){
+    size_t old = out.size();
+    out.resize(old + CAPTURE_CHUNK);
+    ssize_t n = read(fd, out.data() + old, CAPTURE_CHUNK);
+    if(n < 0 && errno == EINTR){
+      out.resize(old);
+      continue;
     }
-    std::cout << std::endl;
-    return 0;
+    out.resize(old + (n > 0 ? (size_t)n : 0));
+    if(n <= 0) break;
   }
+}
 
-  else if(cmd == "cd"){
-
-    //resolving the target
-    std::string target;
-    fs::path old_pwd = fs::current_path();
+//parsed $(...) bodies, so a substitution inside a loop is tokenized and parsed only once
+struct subst_plan {
+  std::shared_ptr<const node> tree;
+  std::string cmd;          //the command's name, a function may shadow it later
+  bool in_process = false;
+};
 
+static std::unordered_map<std::string, subst_plan> subst_cache;
+static constexpr size_t SUBST_CACHE_MAX = 256;
 
-    if (argv.size() == 1){
+//exit status of the last $(...) run while expanding a command, -1 when there was none
+static int subst_status = -1;
 
-      char* home = getenv("HOME");
-      if(!home){
-        std::cerr << "cd: HOME not set" << std::endl;
-        return 1;
-      }
-      else { target = home; }
+//runs body and returns what it wrote to stdout, minus trailing newlines; status gets its exit status
+static std::string command_substitution(const std::string& body, int& status){
+  std::string out;
+  status = 0;
 
+  auto it = subst_cache.find(body);
+  if(it == subst_cache.end()){
+    std::vector<std::string> tokens = tokenizer(body);
+    if(tokenizer_unclosed){
+      std::cerr << "error : unclosed " << tokenizer_unclosed << std::endl;
+      status = 2;
     }
-    else if (argv[1] == "-"){
+    if(tokens.empty()) return out;
+    if(subst_cache.size() >= SUBST_CACHE_MAX) subst_cache.clear();
+    it = subst_cache.emplace(body, subst_plan{parse_shared(tokens), tokens[0], capture_in_process(tokens)}).first;
+  }
+  subst_plan plan = it->second;   //the copy keeps the tree alive if the cache is cleared meanwhile
 
-      char* old = getenv("OLDPWD");
+  bool in_process = plan.in_process && !is_function(plan.cmd);
+  int mfd = in_process ? memfd_create("cmdsub", MFD_CLOEXEC) : -1;
 
-      if(!old){
-        std::cerr << "cd: OLDPWD not set" << std::endl;
-        return 1;
-      }
-      else { target = old; }
-            
+  if(mfd >= 0){
+    int saved = dup(1);
+    dup2(mfd, 1);
+    try{
+      status = exec_node(*plan.tree);
+    }
+    catch(const std::exception& e){
+      std::cerr << e.what() << std::endl;
+      status = 1;
     }
+    std::cout.flush();
+    dup2(saved, 1);
+    close(saved);
+
+    lseek(mfd, 0, SEEK_SET);
+    read_all(mfd, out);
+    close(mfd);
+  }
   else{
-    target = argv[1];
+    int p[2];
+    if(pipe2(p, O_CLOEXEC) < 0){
+      perror("pipe");
+      status = 1;
+      return out;
+    }
+    //a bigger pipe means fewer wakeups for chatty commands
+    fcntl(p[1], F_SETPIPE_SZ, 1 << 20);
 
-    if(!target.empty() && target[0] == '~'){
+    pid_t pid = fork();
+    if(pid < 0){
+      perror("fork");
+      close(p[0]);
+      close(p[1]);
+      status = 1;
+      return out;
+    }
 
-      char* home = getenv("HOME");
-                
-      if(!home){
-      std::cerr << "cd: HOME not set" << std::endl;
+    if(pid == 0){
+      close(p[0]);
+      dup2(p[1], 1);
+      close(p[1]);
+      int st = 1;
+      try{
+        st = exec_node(*plan.tree);
       }
-      else {
-        if(target.size() == 1 ){
-        target = home;
-        }
-        else if( target[1] == '/'){
-          target = std::string(home) + target.substr(1);
-        }
+      catch(const std::exception& e){
+        std::cerr << e.what() << std::endl;
       }
+      std::cout.flush();
+      _exit(st);
     }
+
+    close(p[1]);
+    read_all(p[0], out);
+    close(p[0]);
+
+    int st = 0;
+    while(waitpid(pid, &st, 0) < 0 && errno == EINTR){}
+    status = status_code(st);
   }
 
-  if(target.empty()){
-    return 1;
+  while(!out.empty() && out.back() == '\n'){
+    out.pop_back();
   }
-  //changing the directory
-  else if(chdir(target.c_str()) != 0){
-    std::cerr << "cd: " << target << ": No such file or directory" << std::endl;
-    return 1;
+  return out;
+}
+
+static std::string expand_string(const std::string& raw);
+
+//${NAME}, ${#NAME} and the ${NAME:-word} family (-, =, +, ?, each with or without ':')
+static std::string param_expand(const std::string& body){
+  if(body.size() > 1 && body[0] == '#'){
+    const std::string* v = var_get(var_find(std::string_view(body).substr(1)));
+    return std::to_string(v ? v->size() : 0);
+  }
+
+  size_t j = 0;
+  while(j < body.size() && (isalnum((unsigned char)body[j]) || body[j] == '_')) j++;
+  std::string_view name = std::string_view(body).substr(0, j);
+
+  const std::string* v = nullptr;
+  if(!name.empty() && std::all_of(name.begin(), name.end(), [](char d){ return isdigit((unsigned char)d); })){
+    //${1}, ${10}: positional parameters
+    size_t k = std::stoul(std::string(name));
+    if(k >= 1 && k <= positional().size()) v = &positional()[k - 1];
+  }
+  else if(is_var_name(name)){
+    v = var_get(var_find(name));
   }
   else{
-    //update the enviorment
-    fs::path new_pwd = fs::current_path();
-    setenv("OLDPWD", old_pwd.string().c_str(), 1);
-    setenv("PWD", new_pwd.string().c_str(), 1);
+    throw std::runtime_error("${" + body + "}: bad substitution");
+  }
+
+  //variables are scalars, a subscript picks a space separated field (as in ${PIPESTATUS[1]})
+  std::string field;
+  if(j < body.size() && body[j] == '['){
+    size_t close = body.find(']', j);
+    if(close == std::string::npos){
+      throw std::runtime_error("${" + body + "}: bad substitution");
     }
-  return 0;
+    std::string idx = body.substr(j + 1, close - j - 1);
+    if(v && idx != "@" && idx != "*"){
+      int n = 0;
+      try{
+        n = std::stoi(idx);
+      }catch(...){
+        throw std::runtime_error("${" + body + "}: bad substitution");
+      }
+      size_t at = 0;
+      while(n-- > 0 && at != std::string::npos){
+        at = v->find(' ', at);
+        if(at != std::string::npos) at++;
+      }
+      if(at == std::string::npos){
+        v = nullptr;
+      }
+      else{
+        field = v->substr(at, v->find(' ', at) - at);
+        v = &field;
+      }
+    }
+    j = close + 1;
+  }
 
-  } 
+  if(j == body.size()) return v ? *v : std::string();
 
-  else if (cmd == "type"){
-          
-          //if no commad is provide after the type edge case
-          if(argv.size() < 2){
-            std::cout << "type: missing operand\n";
-            return 1;
-          }
-          
-            // if the command after type are builtin then just showing they are built in
-            if(is_Builtin(argv[1])){
-              std::cout<< argv[1] << " is a shell builtin" << std::endl;
-              return 0;
-            }
+  bool colon = body[j] == ':';
+  size_t k = j + (colon ? 1 : 0);
+  if(k >= body.size()){
+    throw std::runtime_error("${" + body + "}: bad substitution");
+  }
 
-            
-              
-          //get path
-          char* path_env = getenv("PATH");
-          if(!path_env){
-            std::cout << argv[1] << ": not found" << std::endl;
-            return 1;
-          }
+  std::string word = body.substr(k + 1);
+  bool use = v && (!colon || !v->empty());
+
+  switch(body[k]){
+    case '-':
+      return use ? *v : expand_string(word);
+    case '+':
+      return use ? expand_string(word) : std::string();
+    case '=':
+      if(use) return *v;
+      if(!is_var_name(name)){
+        throw std::runtime_error("${" + body + "}: cannot assign in this way");
+      }
+      var_set(var_intern(name), expand_string(word));
+      return *var_get(var_find(name));
+    case '?':
+      if(use) return *v;
+      throw std::runtime_error(std::string(name) + ": " + (word.empty() ? "parameter null or not set" : expand_string(word)));
+  }
+  throw std::runtime_error("${" + body + "}: bad substitution");
+}
 
-              
-          //path seperation
-          std::vector<std::string> dirs;
-          std::string cop;
+//expands one raw token: quote removal, parameter and command substitution, field splitting
+//and globbing; split is off for assignments, which also makes the result exactly one word
+static void expand_word(const std::string& raw, std::vector<std::string>& out, bool split = true){
+  std::string cur;
+  std::vector<size_t> quoted_meta;   //positions in cur of quoted chars that globbing must take literally
+  bool globbing = false;             //an unquoted *, ? or [ was seen
+  bool started = false;              //quotes make a field even when they are empty
+  bool in_dq = false;
+
+  auto quoted = [&](char ch){
+    if(ch == '*' || ch == '?' || ch == '[' || ch == '\\') quoted_meta.push_back(cur.size());
+    cur += ch;
+  };
+
+  auto unquoted = [&](char ch){
+    if(split && (ch == '*' || ch == '?' || ch == '[')) globbing = true;
+    if(ch == '\\') quoted_meta.push_back(cur.size());
+    cur += ch;
+  };
+
+  auto finish = [&](){
+    if(cur.empty() && !started) return;
+
+    bool matched = false;
+    if(globbing){
+      std::string pat;
+      pat.reserve(cur.size() + quoted_meta.size());
+      size_t q = 0;
+      for(size_t k = 0; k < cur.size(); k++){
+        if(q < quoted_meta.size() && quoted_meta[q] == k){
+          pat += '\\';
+          q++;
+        }
+        pat += cur[k];
+      }
+      matched = glob_expand(pat, out);
+    }
+    if(!matched) out.push_back(cur);
+
+    cur.clear();
+    quoted_meta.clear();
+    globbing = false;
+    started = false;
+  };
+
+  //results of $ and ` expansions are split and globbed only outside double quotes
+  auto insert = [&](const std::string& res){
+    for(char ch : res){
+      if(in_dq || !split){
+        quoted(ch);
+      }
+      else if(ch == ' ' || ch == '\t' || ch == '\n'){
+        finish();
+      }
+      else{
+        unquoted(ch);
+      }
+    }
+  };
 
-          for(char *p = path_env; *p != '\0' ; ++p){ //path_env is not a std string
-            if( *p != ':'){
-              cop += *p;
-            }
-            else{
-              if(!cop.empty()){
-                dirs.push_back(cop);
-                cop.clear();
-              }
-            }
+  for(size_t i = 0; i < raw.size(); i++){
+    char c = raw[i];
+
+    if(c == '$' && i + 1 < raw.size() && (raw[i+1] == '(' || raw[i+1] == '{')){
+      size_t end = find_subst_end(raw, i + 1);
+      if(end == std::string::npos) end = raw.size();
+      std::string body = raw.substr(i + 2, end - i - 2);
+      insert(raw[i+1] == '(' ? command_substitution(body, subst_status) : param_expand(body));
+      i = end;
+      continue;
+    }
+
+    if(c == '$' && i + 1 < raw.size() && ((raw[i+1] >= '1' && raw[i+1] <= '9') || raw[i+1] == '#' || raw[i+1] == '@' || raw[i+1] == '*')){
+      char p = raw[++i];
+      const auto& args = positional();
+
+      if(p == '#'){
+        insert(std::to_string(args.size()));
+      }
+      else if(p != '@' && p != '*'){
+        if((size_t)(p - '0') <= args.size()) insert(args[p - '1']);
+      }
+      else{
+        for(size_t k = 0; k < args.size(); k++){
+          //"$@" keeps every parameter a word of its own
+          if(k > 0 && in_dq && p == '@'){
+            finish();
+            started = true;
           }
-          if(!cop.empty()){
-            dirs.push_back(cop);
+          else if(k > 0){
+            insert(" ");
           }
+          insert(args[k]);
+        }
+      }
+      continue;
+    }
+
+    if(c == '$' && i + 1 < raw.size() && raw[i+1] == '?'){
+      insert(std::to_string(last_status));
+      i++;
+      continue;
+    }
+
+    if(c == '$' && i + 1 < raw.size() && (isalpha((unsigned char)raw[i+1]) || raw[i+1] == '_')){
+      size_t end = i + 1;
+      while(end < raw.size() && (isalnum((unsigned char)raw[end]) || raw[end] == '_')) end++;
+      const std::string* v = var_get(var_find(std::string_view(raw).substr(i + 1, end - i - 1)));
+      if(v) insert(*v);
+      i = end - 1;
+      continue;
+    }
+
+    if(c == '`'){
+      size_t end = find_backtick_end(raw, i);
+      if(end == std::string::npos) end = raw.size();
+      std::string body;
+      for(size_t j = i + 1; j < end; j++){
+        if(raw[j] == '\\' && j + 1 < end && (raw[j+1] == '`' || raw[j+1] == '\\' || raw[j+1] == '$')){
+          j++;
+        }
+        body += raw[j];
+      }
+      insert(command_substitution(body, subst_status));
+      i = end;
+      continue;
+    }
+
+    if(in_dq){
+      if(c == '"'){
+        in_dq = false;
+        continue;
+      }
+      if(c == '\\' && i + 1 < raw.size()){
+        char next = raw[i+1];
+        if(next == '"' || next == '\\' || next == '$' || next == '`'){
+          quoted(next);
+          i++;
+          continue;
+        }
+      }
+      quoted(c);
+      continue;
+    }
+
+    if(c == '"'){
+      in_dq = true;
+      started = true;
+      continue;
+    }
+
+    if(c == '\''){
+      size_t end = raw.find('\'', i + 1);
+      if(end == std::string::npos) end = raw.size();
+      for(size_t j = i + 1; j < end; j++){
+        quoted(raw[j]);
+      }
+      started = true;
+      i = end;
+      continue;
+    }
+
+    if(c == '\\' && i + 1 < raw.size()){
+      quoted(raw[++i]);
+      continue;
+    }
+
+    unquoted(c);
+  }
+
+  finish();
+}
+
+//expansion without field splitting or globbing, used for assignment values and ${x:-word}
+static std::string expand_string(const std::string& raw){
+  std::vector<std::string> out;
+  expand_word(raw, out, false);
+  return out.empty() ? std::string() : std::move(out[0]);
+}
+
+//a word prepared at parse time: constant words are expanded once, plain $NAME words keep
+//their variable's id, everything else goes through expand_word() each time
+struct word_plan {
+  enum kind_t { LITERAL, VAR, ARGS, DYNAMIC } kind = DYNAMIC;
+  std::string text;          //LITERAL: the final word, otherwise the raw word
+  uint32_t var = VAR_NONE;   //VAR
+  bool quoted = false;       //VAR inside double quotes, never split
+};
+
+//true when nothing in raw is expanded: no $, no backticks, no unquoted wildcard
+static bool is_static_word(const std::string& raw){
+  char q = 0;
+  for(size_t i = 0; i < raw.size(); i++){
+    char c = raw[i];
+    if(q == '\''){
+      if(c == '\'') q = 0;
+      continue;
+    }
+    if(c == '\\'){
+      i++;
+      continue;
+    }
+    if(c == '$' || c == '`') return false;
+    if(q == '"'){
+      if(c == '"') q = 0;
+      continue;
+    }
+    if(c == '\'' || c == '"'){
+      q = c;
+      continue;
+    }
+    if(c == '*' || c == '?' || c == '[') return false;
+  }
+  return true;
+}
+
+static word_plan compile_word(const std::string& raw){
+  word_plan w;
+  w.text = raw;
+
+  if(raw == "\"$@\""){
+    w.kind = word_plan::ARGS;
+    return w;
+  }
+
+  std::string_view r = raw;
+  bool quoted = r.size() >= 2 && r.front() == '"' && r.back() == '"';
+  if(quoted) r = r.substr(1, r.size() - 2);
+
+  if(r.size() >= 2 && r[0] == '$'){
+    std::string_view name = r.substr(1);
+    if(name.size() >= 2 && name.front() == '{' && name.back() == '}'){
+      name = name.substr(1, name.size() - 2);
+    }
+    if(is_var_name(name)){
+      w.kind = word_plan::VAR;
+      w.var = var_intern(name);
+      w.quoted = quoted;
+      return w;
+    }
+  }
+
+  if(is_static_word(raw)){
+    std::vector<std::string> out;
+    expand_word(raw, out);
+    w.kind = word_plan::LITERAL;
+    w.text = out.empty() ? std::string() : std::move(out[0]);
+  }
+  return w;
+}
+
+static void expand_plan(const word_plan& w, std::vector<std::string>& out){
+  switch(w.kind){
+
+    case word_plan::LITERAL:
+      out.push_back(w.text);
+      return;
+
+    case word_plan::ARGS:
+      out.insert(out.end(), positional().begin(), positional().end());
+      return;
+
+    case word_plan::VAR: {
+      const std::string* v = var_get(w.var);
+      if(w.quoted){
+        out.push_back(v ? *v : std::string());
+        return;
+      }
+      if(!v || v->empty()) return;
+      //nothing to split or glob
+      if(v->find_first_of(" \t\n*?[") == std::string::npos){
+        out.push_back(*v);
+        return;
+      }
+      break;
+    }
+
+    case word_plan::DYNAMIC:
+      break;
+  }
+  expand_word(w.text, out);
+}
+
+//an assignment value: expanded, but never split or globbed
+static std::string expand_plan_string(const word_plan& w){
+  switch(w.kind){
+    case word_plan::LITERAL:
+      return w.text;
+    case word_plan::VAR: {
+      const std::string* v = var_get(w.var);
+      return v ? *v : std::string();
+    }
+    default:
+      return expand_string(w.text);
+  }
+}
+
+std::vector<std::string> expand_words(const std::vector<std::string>& words){
+  std::vector<std::string> out;
+  out.reserve(words.size());
+  for(auto& w : words){
+    expand_word(w, out);
+  }
+  return out;
+}
+
+static bool is_redir_token(const std::string& tok){
+  return tok == ">" || tok == "1>" || tok == ">>" || tok == "<" || tok == "2>" || tok == "2>>" || tok == "1>>"
+      || tok == "<<" || tok == "<<-" || tok == "<<<";
+}
+
+std::pair< std::vector<std::string>, std::vector<Redirection> > RD_tokens (const std::vector<std::string>& tokens){
+
+  std::vector<std::string> argv_tokens;
+  std::vector<Redirection> redirs;
+  
+  
+  size_t i = 0;
+
+  while (i < tokens.size()){
+
+    const std::string& tok = tokens[i];
+
+    if (is_redir_token(tok)){
+
+      if (i + 1 == tokens.size()){
+        throw std::runtime_error("missing filename");
+      }
+
+      Redirection redir;
+
+      if (tok.size() >= 2 && tok[0] == '2' && tok[1] == '>' ){
+        redir.fd = 2;
+      }
+      else if( tok[0] == '<'){
+        redir.fd = 0;
+      }
+      else {
+        redir.fd = 1;
+      }
+
+
+      if  (tok == ">" || tok == "1>" || tok == "2>"){
+        redir.mode = Redirection::TRUNC;
+      }
+      else if (tok == ">>" || tok == "2>>" || tok == "1>>"){
+        redir.mode = Redirection::APPEND;
+      }
+      else if (tok == "<"){
+        redir.mode = Redirection::READ;
+      }
+      else if (tok == "<<<"){
+        redir.mode = Redirection::HERESTRING;
+      }
+      else {
+        redir.mode = Redirection::HEREDOC;
+      }
+
+      redir.filename = tokens[i+1];
+
+      redirs.push_back(redir);
+
+      i+= 2;
+      continue;
+    }
+    else{
+      argv_tokens.push_back(tok);
+      ++i;
+    }
+
+  }
+
+  return { argv_tokens, redirs};
+
+}
+
+//redirection targets must expand to exactly one word; heredoc and here-string data is one
+//string however it expands, never split or globbed
+void RD_expand(std::vector<Redirection>& redirs){
+  for(auto& r : redirs){
+    if(r.mode == Redirection::HEREDOC || r.mode == Redirection::HERESTRING){
+      r.filename = expand_string(r.filename);
+      if(r.mode == Redirection::HERESTRING) r.filename += '\n';
+      continue;
+    }
+
+    std::vector<std::string> words;
+    expand_word(r.filename, words);
+    if(words.size() != 1){
+      throw std::runtime_error(r.filename + ": ambiguous redirect");
+    }
+    r.filename = std::move(words[0]);
+  }
+}
+
+static bool write_all(int fd, const char* data, size_t len){
+  while(len > 0){
+    ssize_t n = write(fd, data, len);
+    if(n < 0){
+      if(errno == EINTR) continue;
+      return false;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static constexpr size_t HEREDOC_PIPE_MAX = 64 * 1024;
+
+//heredoc data goes through a pipe when it fits in the pipe buffer, otherwise through
+//a sealed memfd which also gives the reader a seekable fd
+static int heredoc_fd(const std::string& data){
+  if(data.size() <= HEREDOC_PIPE_MAX){
+    int p[2];
+    if(pipe2(p, O_CLOEXEC) == 0){
+      int cap = fcntl(p[1], F_GETPIPE_SZ);
+      if(cap > 0 && data.size() <= (size_t)cap && write_all(p[1], data.data(), data.size())){
+        close(p[1]);
+        return p[0];
+      }
+      close(p[0]);
+      close(p[1]);
+    }
+  }
+
+  int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd < 0) return -1;
+
+  if(!write_all(fd, data.data(), data.size())){
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+}
+
+bool RD_apply( const std::vector<Redirection>& redirs, bool in_child){
+
+  for( const auto& r : redirs){
+
+    int fd;
+
+    if ( r.mode == Redirection::READ){
+      fd = open(r.filename.c_str(), O_RDONLY);
+    }
+    else if (r.mode == Redirection::HEREDOC || r.mode == Redirection::HERESTRING){
+      fd = heredoc_fd(r.filename);
+      if(fd < 0){
+        perror("here-document");
+        if(in_child) _exit(1);
+        return false;
+      }
+    }
+    else if(r.mode == Redirection::TRUNC){
+      fd = open(r.filename.c_str() , O_WRONLY | O_CREAT | O_TRUNC, 0644); //permission is set to 0644 (read/write for owners  and read for others)
+    }
+    else{
+      fd = open(r.filename.c_str() , O_WRONLY | O_CREAT | O_APPEND, 0644);
+    }
+
+    if(fd < 0){
+      perror(r.filename.c_str());
+      if(in_child) _exit(1);
+      return false;
+    }
+
+    if(dup2(fd, r.fd) < 0) {
+        perror("dup2");
+        if(in_child) _exit(1);
+        return false;
+    }
+    close(fd);
+
+  }
+  return true;
+}
+
+struct node;
+
+struct command {
+  std::vector<std::string> argv;
+  std::vector<Redirection> redirs;
+  std::vector<std::pair<uint32_t, std::string>> assigns;   //NAME=value prefixes
+  std::string path;                                         //resolved executable for non-builtins
+  const node* body = nullptr;                               //compound pipeline stage
+  std::shared_ptr<const node> fn;                           //shell function being called
+  bool is_builtin = false;
+};
+
+//parsed command line; it is only read while executing, so one tree can run many times
+struct node {
+  enum kind_t { SIMPLE, PIPELINE, AND, OR, LIST, SUBSHELL, GROUP, IF, WHILE, UNTIL, FOR, FUNCDEF } kind;
+  command cmd;                                            //SIMPLE: redirections, FUNCDEF: the name in argv
+  std::vector<word_plan> words;                           //SIMPLE: argv, FOR: the words after 'in'
+  std::vector<std::pair<uint32_t, word_plan>> assigns;    //SIMPLE: NAME=value prefixes
+  std::vector<std::unique_ptr<node>> kids;                //IF: condition/body pairs, then an optional else body
+  std::vector<Redirection> redirs;                        //compound commands
+  std::shared_ptr<const node> fn;                         //FUNCDEF: the body
+  uint32_t var = VAR_NONE;                                //FOR: the loop variable
+  bool for_in = false;                                    //FOR: has an 'in' list, otherwise "$@"
+};
+
+static std::unordered_map<std::string, std::shared_ptr<const node>, sv_hash, std::equal_to<>> functions;
+
+static bool is_function(std::string_view name){
+  return functions.find(name) != functions.end();
+}
+
+//thrown when the tokens end in the middle of a construct, so more lines can be read
+struct incomplete_input : std::runtime_error {
+  incomplete_input() : std::runtime_error("syntax error: unexpected end of file") {}
+};
+
+static std::runtime_error syntax_error(const std::string& tok){
+  return std::runtime_error("syntax error near unexpected token `" + (tok == "\n" ? std::string("newline") : tok) + "'");
+}
+
+static void skip_newlines(const std::vector<std::string>& t, size_t& i){
+  while(i < t.size() && t[i] == "\n") i++;
+}
+
+using stop_words = std::initializer_list<std::string_view>;
+
+static std::unique_ptr<node> parse_list(const std::vector<std::string>& t, size_t& i, stop_words stops);
+
+static void expect(const std::vector<std::string>& t, size_t& i, std::string_view word){
+  if(i == t.size()) throw incomplete_input();
+  if(t[i] != word) throw syntax_error(t[i]);
+  i++;
+}
+
+//a list that must contain at least one command, e.g. an if condition or a loop body
+static std::unique_ptr<node> parse_body(const std::vector<std::string>& t, size_t& i, stop_words stops){
+  auto n = parse_list(t, i, stops);
+  if(n->kind == node::LIST && n->kids.empty()){
+    if(i == t.size()) throw incomplete_input();
+    throw syntax_error(t[i]);
+  }
+  return n;
+}
+
+//redirections after ')' or '}'
+static std::vector<Redirection> parse_compound_redirs(const std::vector<std::string>& t, size_t& i){
+  std::vector<std::string> words;
+  while(i < t.size() && is_redir_token(t[i])){
+    words.push_back(t[i++]);
+    if(i < t.size() && !is_control_token(t[i])) words.push_back(t[i++]);
+  }
+  if(i < t.size() && !is_control_token(t[i])){
+    throw syntax_error(t[i]);
+  }
+  return RD_tokens(words).second;
+}
+
+//splits leading NAME=value words off and prepares the rest of argv
+static void compile_simple(node& n){
+  size_t k = 0;
+  for(; k < n.cmd.argv.size(); k++){
+    const std::string& w = n.cmd.argv[k];
+    size_t eq = w.find('=');
+    if(eq == std::string::npos || !is_var_name(std::string_view(w).substr(0, eq))) break;
+    n.assigns.emplace_back(var_intern(std::string_view(w).substr(0, eq)), compile_word(w.substr(eq + 1)));
+  }
+  for(; k < n.cmd.argv.size(); k++){
+    n.words.push_back(compile_word(n.cmd.argv[k]));
+  }
+}
+
+static std::unique_ptr<node> parse_command(const std::vector<std::string>& t, size_t& i);
+
+static std::unique_ptr<node> parse_if(const std::vector<std::string>& t, size_t& i){
+  auto n = std::make_unique<node>();
+  n->kind = node::IF;
+  i++;
+
+  n->kids.push_back(parse_body(t, i, {"then"}));
+  expect(t, i, "then");
+  n->kids.push_back(parse_body(t, i, {"elif", "else", "fi"}));
+
+  while(i < t.size() && t[i] == "elif"){
+    i++;
+    n->kids.push_back(parse_body(t, i, {"then"}));
+    expect(t, i, "then");
+    n->kids.push_back(parse_body(t, i, {"elif", "else", "fi"}));
+  }
+
+  if(i < t.size() && t[i] == "else"){
+    i++;
+    n->kids.push_back(parse_body(t, i, {"fi"}));
+  }
+  expect(t, i, "fi");
+  return n;
+}
+
+static std::unique_ptr<node> parse_while(const std::vector<std::string>& t, size_t& i){
+  auto n = std::make_unique<node>();
+  n->kind = (t[i] == "while") ? node::WHILE : node::UNTIL;
+  i++;
+
+  n->kids.push_back(parse_body(t, i, {"do"}));
+  expect(t, i, "do");
+  n->kids.push_back(parse_body(t, i, {"done"}));
+  expect(t, i, "done");
+  return n;
+}
+
+static std::unique_ptr<node> parse_for(const std::vector<std::string>& t, size_t& i){
+  auto n = std::make_unique<node>();
+  n->kind = node::FOR;
+  i++;
+
+  if(i == t.size()) throw incomplete_input();
+  if(!is_var_name(t[i])) throw syntax_error(t[i]);
+  n->var = var_intern(t[i]);
+  i++;
+  skip_newlines(t, i);
+
+  if(i < t.size() && t[i] == "in"){
+    i++;
+    n->for_in = true;
+    while(i < t.size() && !is_control_token(t[i])){
+      n->words.push_back(compile_word(t[i++]));
+    }
+    if(i == t.size()) throw incomplete_input();
+    if(t[i] != ";" && t[i] != "\n") throw syntax_error(t[i]);
+    i++;
+  }
+  else if(i < t.size() && t[i] == ";"){
+    i++;
+  }
+
+  skip_newlines(t, i);
+  expect(t, i, "do");
+  n->kids.push_back(parse_body(t, i, {"done"}));
+  expect(t, i, "done");
+  return n;
+}
+
+//name () compound-command, or: function name [()] compound-command
+static std::unique_ptr<node> parse_funcdef(const std::vector<std::string>& t, size_t& i){
+  auto n = std::make_unique<node>();
+  n->kind = node::FUNCDEF;
+
+  if(t[i] == "function"){
+    i++;
+    if(i == t.size()) throw incomplete_input();
+    if(is_control_token(t[i])) throw syntax_error(t[i]);
+    n->cmd.argv.push_back(t[i++]);
+    if(i < t.size() && t[i] == "("){
+      i++;
+      expect(t, i, ")");
+    }
+  }
+  else{
+    n->cmd.argv.push_back(t[i]);
+    i += 3;
+  }
+
+  if(!is_static_word(n->cmd.argv[0]) || n->cmd.argv[0].find_first_of("'\"\\") != std::string::npos){
+    throw std::runtime_error("`" + n->cmd.argv[0] + "': not a valid identifier");
+  }
+
+  skip_newlines(t, i);
+  size_t start = i;
+  auto body = parse_command(t, i);
+  if(body->kind == node::SIMPLE || body->kind == node::FUNCDEF){
+    throw syntax_error(t[start]);
+  }
+  n->fn = std::move(body);
+  return n;
+}
+
+static std::unique_ptr<node> parse_command(const std::vector<std::string>& t, size_t& i){
+  if(i == t.size()) throw incomplete_input();
+
+  const std::string& w = t[i];
+  std::unique_ptr<node> n;
+
+  if(w == "(" || w == "{"){
+    bool sub = (w == "(");
+    const std::string_view close = sub ? ")" : "}";
+    i++;
+
+    n = std::make_unique<node>();
+    n->kind = sub ? node::SUBSHELL : node::GROUP;
+    n->kids.push_back(parse_body(t, i, {close}));
+    expect(t, i, close);
+  }
+  else if(w == "if"){
+    n = parse_if(t, i);
+  }
+  else if(w == "while" || w == "until"){
+    n = parse_while(t, i);
+  }
+  else if(w == "for"){
+    n = parse_for(t, i);
+  }
+  else if(w == "function" || (!is_control_token(w) && i + 2 < t.size() && t[i+1] == "(" && t[i+2] == ")")){
+    return parse_funcdef(t, i);
+  }
+  else{
+    std::vector<std::string> words;
+    while(i < t.size() && !is_control_token(t[i])){
+      words.push_back(t[i++]);
+    }
+    if(words.empty()){
+      throw syntax_error(t[i]);
+    }
+
+    auto [argv_raw, redirs] = RD_tokens(words);
+    n = std::make_unique<node>();
+    n->kind = node::SIMPLE;
+    n->cmd.argv = std::move(argv_raw);
+    n->cmd.redirs = std::move(redirs);
+    compile_simple(*n);
+    return n;
+  }
+
+  n->redirs = parse_compound_redirs(t, i);
+  return n;
+}
+
+static std::unique_ptr<node> parse_pipeline(const std::vector<std::string>& t, size_t& i){
+  auto first = parse_command(t, i);
+  if(i == t.size() || t[i] != "|") return first;
+
+  auto n = std::make_unique<node>();
+  n->kind = node::PIPELINE;
+  n->kids.push_back(std::move(first));
+  while(i < t.size() && t[i] == "|"){
+    i++;
+    skip_newlines(t, i);
+    n->kids.push_back(parse_command(t, i));
+  }
+  return n;
+}
+
+static std::unique_ptr<node> parse_and_or(const std::vector<std::string>& t, size_t& i){
+  auto left = parse_pipeline(t, i);
+
+  while(i < t.size() && (t[i] == "&&" || t[i] == "||")){
+    auto n = std::make_unique<node>();
+    n->kind = (t[i] == "&&") ? node::AND : node::OR;
+    i++;
+    skip_newlines(t, i);
+    n->kids.push_back(std::move(left));
+    n->kids.push_back(parse_pipeline(t, i));
+    left = std::move(n);
+  }
+  return left;
+}
+
+//commands separated by ';' or newlines, up to one of the stop words in command position (or the end)
+static std::unique_ptr<node> parse_list(const std::vector<std::string>& t, size_t& i, stop_words stops){
+  auto list = std::make_unique<node>();
+  list->kind = node::LIST;
+
+  while(true){
+    skip_newlines(t, i);
+    if(i == t.size() || std::find(stops.begin(), stops.end(), t[i]) != stops.end()) break;
+
+    list->kids.push_back(parse_and_or(t, i));
+
+    if(i < t.size() && (t[i] == ";" || t[i] == "\n")){
+      i++;
+      continue;
+    }
+    break;
+  }
+
+  if(list->kids.size() == 1) return std::move(list->kids[0]);
+  return list;
+}
+
+std::unique_ptr<node> parse_tokens(const std::vector<std::string>& tokens){
+  size_t i = 0;
+  auto tree = parse_list(tokens, i, {});
+  if(i != tokens.size()){
+    throw syntax_error(tokens[i]);
+  }
+  return tree;
+}
+
+std::shared_ptr<const node> parse_shared(const std::vector<std::string>& tokens){
+  return parse_tokens(tokens);
+}
+
+//fastutils: grep (fixed strings), wc and head without a fork+exec. Input is read in
+//large blocks; newlines are found with memchr/std::count and patterns with memmem,
+//which glibc vectorises, and a match is searched across a whole block before its
+//line is located.
+constexpr size_t FASTUTIL_CHUNK = 256 * 1024;
+
+struct fastutil_opts {
+  bool invert = false, count = false, number = false, quiet = false;   //grep
+  bool lines = false, words = false, bytes = false;                     //wc
+  long long n = 10;                                                     //head
+  std::string pattern;
+  std::vector<std::string> files;
+};
+
+//parses argv into o, false for options the builtin does not implement
+static bool fastutil_parse(const std::vector<std::string>& argv, fastutil_opts& o){
+  const std::string& cmd = argv[0];
+  bool fixed = false;
+  size_t i = 1;
+  for(; i < argv.size(); i++){
+    const std::string& a = argv[i];
+    if(a == "--"){
+      i++;
+      break;
+    }
+    if(a.size() < 2 || a[0] != '-') break;
+
+    if(cmd == "head"){
+      std::string num;
+      if(a == "-n"){
+        if(++i == argv.size()) return false;
+        num = argv[i];
+      }
+      else if(a.compare(0, 2, "-n") == 0) num = a.substr(2);
+      else num = a.substr(1);
+      //anything that is not a plain count in range is left to the real head
+      auto [end, err] = std::from_chars(num.data(), num.data() + num.size(), o.n);
+      if(num.empty() || num[0] == '-' || err != std::errc() || end != num.data() + num.size()) return false;
+      continue;
+    }
+
+    for(size_t k = 1; k < a.size(); k++){
+      char f = a[k];
+      if(cmd == "grep"){
+        if(f == 'F') fixed = true;
+        else if(f == 'v') o.invert = true;
+        else if(f == 'c') o.count = true;
+        else if(f == 'n') o.number = true;
+        else if(f == 'q') o.quiet = true;
+        else return false;
+      }
+      else{
+        if(f == 'l') o.lines = true;
+        else if(f == 'w') o.words = true;
+        else if(f == 'c') o.bytes = true;
+        else return false;
+      }
+    }
+  }
+
+  if(cmd == "grep"){
+    if(i == argv.size()) return false;
+    o.pattern = argv[i++];
+    //without -F only patterns that are plain strings in a basic regex qualify
+    if(!fixed && o.pattern.find_first_of(".[]*^$\\") != std::string::npos) return false;
+  }
+  if(cmd == "wc" && !o.lines && !o.words && !o.bytes){
+    o.lines = o.words = o.bytes = true;
+  }
+  o.files.assign(argv.begin() + i, argv.end());
+  return true;
+}
+
+//true when argv can run as a fastutil instead of the external command
+static bool fastutil_applies(const std::vector<std::string>& argv){
+  fastutil_opts o;
+  return is_fastutil(argv[0]) && fastutil_parse(argv, o);
+}
+
+//output is gathered and written in large pieces rather than per line
+struct fastutil_out {
+  std::string buf;
+  bool failed = false;
+
+  void put(const char* p, size_t n){
+    buf.append(p, n);
+    if(buf.size() >= FASTUTIL_CHUNK) flush();
+  }
+  void put(const std::string& str){ put(str.data(), str.size()); }
+  void flush(){
+    if(!buf.empty() && !write_all(1, buf.data(), buf.size())) failed = true;
+    buf.clear();
+  }
+};
+
+static int fastutil_open(const std::string& cmd, const std::string& file){
+  if(file == "-") return 0;
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) std::cerr << cmd << ": " << file << ": " << strerror(errno) << std::endl;
+  return fd;
+}
+
+//calls fn(data, len) with blocks that end on a line boundary; a last line without a
+//newline gets one. fn returns false to stop reading.
+template<class F>
+static bool fastutil_lines(int fd, F&& fn){
+  std::string buf(FASTUTIL_CHUNK, '\0');
+  size_t have = 0;
+  while(true){
+    if(have == buf.size()) buf.resize(buf.size() * 2);   //a line longer than the buffer
+    ssize_t r = read(fd, &buf[have], buf.size() - have);
+    if(r < 0){
+      if(errno == EINTR) continue;
+      return false;
+    }
+    if(r == 0) break;
+    have += r;
+
+    const char* last = (const char*)memrchr(buf.data(), '\n', have);
+    if(!last) continue;
+    size_t len = last - buf.data() + 1;
+    if(!fn(buf.data(), len)) return true;
+    memmove(&buf[0], buf.data() + len, have - len);
+    have -= len;
+  }
+  if(have){
+    buf.resize(have);
+    buf += '\n';
+    fn(buf.data(), buf.size());
+  }
+  return true;
+}
+
+//grep over one input, returns the number of selected lines (stops after one under -q)
+static long long fastutil_grep_fd(int fd, const fastutil_opts& o, const std::string& prefix, fastutil_out& out){
+  const std::string& pat = o.pattern;
+  long long selected = 0;
+  long long lineno = 1;
+
+  auto emit = [&](const char* ls, const char* le){
+    selected++;
+    if(o.count || o.quiet) return;
+    out.put(prefix);
+    if(o.number) out.put(std::to_string(lineno) + ":");
+    out.put(ls, le - ls);
+  };
+
+  fastutil_lines(fd, [&](const char* p, size_t len){
+    const char* end = p + len;
+    if(!o.invert){
+      const char* counted = p;
+      while(p < end){
+        const char* hit = (const char*)memmem(p, end - p, pat.data(), pat.size());
+        if(!hit) break;
+        const char* ls = (const char*)memrchr(p, '\n', hit - p);
+        ls = ls ? ls + 1 : p;
+        const char* le = (const char*)memchr(hit, '\n', end - hit) + 1;
+        if(o.number){
+          lineno += std::count(counted, ls, '\n');
+          counted = ls;
+        }
+        emit(ls, le);
+        if(o.quiet) return false;
+        p = le;
+      }
+      if(o.number) lineno += std::count(counted, end, '\n');
+      return true;
+    }
+
+    while(p < end){
+      const char* le = (const char*)memchr(p, '\n', end - p) + 1;
+      if(!memmem(p, le - p - 1, pat.data(), pat.size())){
+        emit(p, le);
+        if(o.quiet) return false;
+      }
+      p = le;
+      lineno++;
+    }
+    return true;
+  });
+  return selected;
+}
+
+static int fastutil_grep(const fastutil_opts& o){
+  fastutil_out out;
+  std::vector<std::string> files = o.files;
+  if(files.empty()) files.push_back("-");
+  bool named = files.size() > 1;
+
+  long long total = 0;
+  bool error = false;
+  for(auto& f : files){
+    int fd = fastutil_open("grep", f);
+    if(fd < 0){
+      error = true;
+      continue;
+    }
+    std::string prefix = named ? (f == "-" ? "(standard input)" : f) + ":" : "";
+    long long n = fastutil_grep_fd(fd, o, prefix, out);
+    if(fd > 2) close(fd);
+    total += n;
+    if(o.count && !o.quiet) out.put(prefix + std::to_string(n) + "\n");
+    if(o.quiet && total) break;
+  }
+  out.flush();
+  if(error && !(o.quiet && total)) return 2;
+  return total ? 0 : 1;
+}
+
+static int fastutil_wc(const fastutil_opts& o){
+  struct counts { long long lines = 0, words = 0, bytes = 0; };
+  std::vector<std::pair<std::string, counts>> results;
+  std::vector<std::string> files = o.files;
+  bool from_stdin = files.empty();
+  if(from_stdin) files.push_back("-");
+
+  bool error = false;
+  std::string buf(FASTUTIL_CHUNK, '\0');
+  for(auto& f : files){
+    int fd = fastutil_open("wc", f);
+    if(fd < 0){
+      error = true;
+      continue;
+    }
+    counts c;
+    bool in_word = false;
+    ssize_t r;
+    while((r = read(fd, &buf[0], buf.size())) != 0){
+      if(r < 0){
+        if(errno == EINTR) continue;
+        break;
+      }
+      const char* p = buf.data();
+      c.bytes += r;
+      if(o.lines) c.lines += std::count(p, p + r, '\n');
+      if(o.words){
+        for(ssize_t k = 0; k < r; k++){
+          bool space = isspace((unsigned char)p[k]);
+          if(!space && !in_word) c.words++;
+          in_word = !space;
+        }
+      }
+    }
+    if(fd > 2) close(fd);
+    results.emplace_back(from_stdin ? "" : f, c);
+  }
+  if(results.size() > 1){
+    counts t;
+    for(auto& [name, c] : results){
+      t.lines += c.lines;
+      t.words += c.words;
+      t.bytes += c.bytes;
+    }
+    results.emplace_back("total", t);
+  }
+
+  //columns are as wide as the largest byte count, like coreutils
+  int columns = o.lines + o.words + o.bytes;
+  int width = 1;
+  if(columns > 1 || results.size() > 1){
+    width = from_stdin ? 7 : 1;
+    for(auto& r : results) width = std::max(width, (int)std::to_string(r.second.bytes).size());
+  }
+
+  fastutil_out out;
+  for(auto& [name, c] : results){
+    std::string line;
+    auto col = [&](long long v){
+      std::string num = std::to_string(v);
+      if(!line.empty()) line += ' ';
+      if((int)num.size() < width) line.append(width - num.size(), ' ');
+      line += num;
+    };
+    if(o.lines) col(c.lines);
+    if(o.words) col(c.words);
+    if(o.bytes) col(c.bytes);
+    if(!name.empty()) line += " " + name;
+    line += '\n';
+    out.put(line);
+  }
+  out.flush();
+  return error ? 1 : 0;
+}
+
+static int fastutil_head(const fastutil_opts& o){
+  fastutil_out out;
+  std::vector<std::string> files = o.files;
+  if(files.empty()) files.push_back("-");
+
+  bool error = false;
+  std::string buf(FASTUTIL_CHUNK, '\0');
+  for(size_t i = 0; i < files.size(); i++){
+    int fd = fastutil_open("head", files[i]);
+    if(fd < 0){
+      error = true;
+      continue;
+    }
+    if(files.size() > 1){
+      out.put(std::string(i ? "\n" : "") + "==> " +
+              (files[i] == "-" ? "standard input" : files[i]) + " <==\n");
+    }
+
+    long long left = o.n;
+    while(left > 0){
+      ssize_t r = read(fd, &buf[0], buf.size());
+      if(r < 0 && errno == EINTR) continue;
+      if(r <= 0) break;
+      const char* p = buf.data();
+      const char* end = p + r;
+      while(left > 0 && p < end){
+        const char* nl = (const char*)memchr(p, '\n', end - p);
+        if(!nl) break;
+        p = nl + 1;
+        left--;
+      }
+      out.put(buf.data(), (left ? end : p) - buf.data());
+    }
+
+    if(fd > 2) close(fd);
+    else{
+      //the rest of a pipe is not wanted: drop the read end now so the writer gets
+      //SIGPIPE instead of filling the pipe until this stage exits
+      struct stat st;
+      int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+      if(fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode) && null_fd >= 0) dup2(null_fd, fd);
+      if(null_fd >= 0) close(null_fd);
+    }
+  }
+  out.flush();
+  return error ? 1 : 0;
+}
+
+static int run_fastutil(const std::vector<std::string>& argv){
+  fastutil_opts o;
+  if(!fastutil_parse(argv, o)){
+    std::cerr << argv[0] << ": options not supported by the builtin" << std::endl;
+    return 2;
+  }
+  if(argv[0] == "grep") return fastutil_grep(o);
+  if(argv[0] == "wc") return fastutil_wc(o);
+  return fastutil_head(o);
+}
+
+static int run_xargs(const std::vector<std::string>& argv);
+
+int run_builtin(const std::vector<std::string>& argv, bool in_child){
+
+  (void)in_child;
+  if(argv.empty()) return 0;
+  const std::string & cmd = argv[0];
+
+  if(cmd == "exit"){
+    return 0;
+  }
+
+  else if(is_fastutil(cmd)){
+    return run_fastutil(argv);
+  }
+
+  else if(cmd == "xargs"){
+    return run_xargs(argv);
+  }
+
+  else if(cmd == "builtin"){
+    if(argv.size() < 2) return 0;
+    if(!is_Builtin(argv[1]) && !is_fastutil(argv[1])){
+      std::cerr << "builtin: " << argv[1] << ": not a shell builtin" << std::endl;
+      return 1;
+    }
+    return run_builtin(std::vector<std::string>(argv.begin() + 1, argv.end()), in_child);
+  }
+
+  else if(cmd == "pwd"){
+    try{
+      fs::path currentPath = fs::current_path();
+      std::cout << currentPath.string() << std::endl;
+    }
+    catch (const fs::filesystem_error & e) {
+      std::cerr << "filesystem error : " << e.what() << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  else if (cmd == "echo") {
+    //one write per echo, std::cout is unit-buffered
+    std::string line;
+    for( size_t i = 1 ; i < argv.size() ; ++i){
+            line += argv[i];
+            if(i + 1 < argv.size()){
+              line += ' ';
+            }
+    }
+    line += '\n';
+    std::cout << line;
+    return 0;
+  }
+
+  else if (cmd == "break" || cmd == "continue"){
+    int n = 1;
+    if(argv.size() > 1){
+      try{
+        n = std::stoi(argv[1]);
+      }catch(...){
+        n = 0;
+      }
+      if(n < 1){
+        std::cerr << cmd << ": " << argv[1] << ": loop count out of range" << std::endl;
+        return 1;
+      }
+    }
+    if(loop_depth == 0){
+      std::cerr << cmd << ": only meaningful in a `for', `while', or `until' loop" << std::endl;
+      return 0;
+    }
+    n = std::min(n, loop_depth);
+    if(cmd == "break") loop_break = n;
+    else loop_continue = n;
+    return 0;
+  }
+
+  else if (cmd == "return"){
+    if(call_stack.empty()){
+      std::cerr << "return: can only `return' from a function" << std::endl;
+      return 1;
+    }
+    return_status = last_status;
+    if(argv.size() > 1){
+      try{
+        return_status = std::stoi(argv[1]) & 0xff;
+      }catch(...){
+        std::cerr << "return: " << argv[1] << ": numeric argument required" << std::endl;
+        return_status = 2;
+      }
+    }
+    func_returning = true;
+    return return_status;
+  }
+
+  else if (cmd == "local"){
+    if(call_stack.empty()){
+      std::cerr << "local: can only be used in a function" << std::endl;
+      return 1;
+    }
+    auto& locals = call_stack.back().locals;
+    int st = 0;
+    for(size_t i = 1; i < argv.size(); ++i){
+      size_t eq = argv[i].find('=');
+      std::string_view name = std::string_view(argv[i]).substr(0, eq);
+      if(!is_var_name(name)){
+        std::cerr << "local: `" << argv[i] << "': not a valid identifier" << std::endl;
+        st = 1;
+        continue;
+      }
+      uint32_t id = var_intern(name);
+      bool saved = false;
+      for(auto& l : locals){
+        if(l.first == id) saved = true;
+      }
+      if(!saved){
+        locals.emplace_back(id, vars[id]);
+        var_unset(id);
+      }
+      if(eq != std::string::npos){
+        var_set(id, argv[i].substr(eq + 1));
+      }
+    }
+    return st;
+  }
+
+  else if (cmd == "shift"){
+    if(call_stack.empty()) return 1;
+    auto& args = call_stack.back().args;
+    size_t n = 1;
+    if(argv.size() > 1){
+      try{
+        n = std::stoul(argv[1]);
+      }catch(...){
+        std::cerr << "shift: " << argv[1] << ": numeric argument required" << std::endl;
+        return 1;
+      }
+    }
+    if(n > args.size()) return 1;
+    args.erase(args.begin(), args.begin() + n);
+    return 0;
+  }
+
+  else if(cmd == "cd"){
+
+    //resolving the target
+    std::string target;
+    fs::path old_pwd = fs::current_path();
+
+
+    if (argv.size() == 1){
+
+      const char* home = var_cstr("HOME");
+      if(!home){
+        std::cerr << "cd: HOME not set" << std::endl;
+        return 1;
+      }
+      else { target = home; }
+
+    }
+    else if (argv[1] == "-"){
+
+      const char* old = var_cstr("OLDPWD");
+
+      if(!old){
+        std::cerr << "cd: OLDPWD not set" << std::endl;
+        return 1;
+      }
+      else { target = old; }
+            
+    }
+  else{
+    target = argv[1];
+
+    if(!target.empty() && target[0] == '~'){
+
+      const char* home = var_cstr("HOME");
+                
+      if(!home){
+      std::cerr << "cd: HOME not set" << std::endl;
+      }
+      else {
+        if(target.size() == 1 ){
+        target = home;
+        }
+        else if( target[1] == '/'){
+          target = std::string(home) + target.substr(1);
+        }
+      }
+    }
+  }
+
+  if(target.empty()){
+    return 1;
+  }
+  //changing the directory
+  else if(chdir(target.c_str()) != 0){
+    std::cerr << "cd: " << target << ": No such file or directory" << std::endl;
+    return 1;
+  }
+  else{
+    //update the enviorment
+    fs::path new_pwd = fs::current_path();
+    var_set(var_intern("OLDPWD"), old_pwd.string());
+    var_set(var_intern("PWD"), new_pwd.string());
+    }
+  return 0;
+
+  } 
+
+  else if (cmd == "type"){
+          
+          //if no commad is provide after the type edge case
+          if(argv.size() < 2){
+            std::cout << "type: missing operand\n";
+            return 1;
+          }
+          
+            // if the command after type are builtin then just showing they are built in
+            if(functions.count(argv[1])){
+              std::cout<< argv[1] << " is a function" << std::endl;
+              return 0;
+            }
+
+            if(is_Builtin(argv[1]) || (opt_fastutils && is_fastutil(argv[1]))){
+              std::cout<< argv[1] << " is a shell builtin" << std::endl;
+              return 0;
+            }
+
+            
+              
+          //get path
+          const char* path_env = var_cstr("PATH");
+          if(!path_env){
+            std::cout << argv[1] << ": not found" << std::endl;
+            return 1;
+          }
+
+              
+          //path seperation
+          std::vector<std::string> dirs;
+          std::string cop;
+
+          for(const char *p = path_env; *p != '\0' ; ++p){ //path_env is not a std string
+            if( *p != ':'){
+              cop += *p;
+            }
+            else{
+              if(!cop.empty()){
+                dirs.push_back(cop);
+                cop.clear();
+              }
+            }
+          }
+          if(!cop.empty()){
+            dirs.push_back(cop);
+          }
+
+          //path lookup
+
+          for(const auto& dir : dirs){
+          std::string fullPath = dir + "/" + argv[1];
+
+            if(access(fullPath.c_str(), F_OK) != 0){
+              continue;
+            }
+
+            if(access(fullPath.c_str(), X_OK) != 0){
+              continue;
+            }
+
+            std::cout << argv[1] << " is " << fullPath << std::endl;    
+            return 0;
+          }
+
+                
+    std::cout << argv[1] << ": not found" << std::endl;
+    return 1;
+                
+  }
+     
+  
+  else if (cmd == "export"){
+
+    if(argv.size() == 1){
+      std::vector<uint32_t> ids;
+      for(uint32_t id = 0; id < vars.size(); id++){
+        if(vars[id].set && vars[id].exported) ids.push_back(id);
+      }
+      std::sort(ids.begin(), ids.end(), [](uint32_t a, uint32_t b){ return var_names[a] < var_names[b]; });
+      for(auto id : ids){
+        std::cout << "declare -x " << var_names[id] << "=\"" << vars[id].value << "\"" << std::endl;
+      }
+      return 0;
+    }
+
+    int st = 0;
+    for(size_t i = 1; i < argv.size(); ++i){
+      size_t eq = argv[i].find('=');
+      std::string_view name = std::string_view(argv[i]).substr(0, eq);
+      if(!is_var_name(name)){
+        std::cerr << "export: `" << argv[i] << "': not a valid identifier" << std::endl;
+        st = 1;
+        continue;
+      }
+      uint32_t id = var_intern(name);
+      if(eq != std::string::npos){
+        var_set(id, argv[i].substr(eq + 1));
+      }
+      var_export(id);
+    }
+    return st;
+  }
+
+  else if (cmd == "set"){
+
+    if(argv.size() == 1 || (argv.size() == 2 && (argv[1] == "-o" || argv[1] == "+o"))){
+      for(auto& [name, flag] : shell_options){
+        std::cout << name << (strlen(name) < 8 ? "\t\t" : "\t") << (*flag ? "on" : "off") << std::endl;
+      }
+      return 0;
+    }
+
+    for(size_t i = 1; i < argv.size(); ++i){
+      if((argv[i] != "-o" && argv[i] != "+o") || i + 1 == argv.size()){
+        std::cerr << "set: " << argv[i] << ": invalid option" << std::endl;
+        return 2;
+      }
+      bool on = argv[i] == "-o";
+      const std::string& name = argv[++i];
+      bool found = false;
+      for(auto& [opt, flag] : shell_options){
+        if(name == opt){
+          *flag = on;
+          found = true;
+        }
+      }
+      if(!found){
+        std::cerr << "set: " << name << ": invalid option name" << std::endl;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  else if (cmd == "unset"){
+    for(size_t i = 1; i < argv.size(); ++i){
+      var_unset(var_find(argv[i]));
+    }
+    return 0;
+  }
+
+  else if (cmd == "history"){
+
+    if(argv.size() == 3 && argv[1] == "-a"){
+      if(!history_append_file(argv[2], session_start_index)){
+        std::cerr << "history: failed to append file" << std::endl;
+        return 1;
+      }
+      session_start_index = history.size();
+      return 0;
+    }
+
+    if(argv.size() == 3 && argv[1] == "-w"){
+      if(!history_write_file(argv[2], false)){
+        std::cerr << "history: failed to write file" << std::endl;
+        return 1;
+      }
+      session_start_index = history.size();
+      return 0;
+    }
+
+    if(argv.size() ==  3 && argv[1] == "-r"){
+      size_t added = history_read_file(argv[2]);
+
+      size_t start = (added <= history.size()) ? (history.size() - added) : 0;
+      for (size_t i = start; i < history.size(); ++i){
+        add_history(atom_cstr(history[i]));
+      }
+
+      session_start_index = history.size();
+      return 0;
+    }
+
+    if(argv.size() == 2 && argv[1] == "-c"){
+      history_clear();
+      clear_history();
+      if(!history_write_file(HISTFILE, true)){
+        std::cerr << "history: failed to write file" << std::endl;
+      }
+      session_start_index = 0;
+      return 0;
+    }
+
+    size_t start = 0;
+    if(argv.size() == 2){
+      try{
+        int n = std::stoi(argv[1]);
+        if(n < 0) n=0;
+        if((size_t)n < history.size()) start = history.size() - (size_t)n;
+      }catch(...){
+
+      }
+    }
+
+    for (size_t i = start; i < history.size(); ++i){
+      std::cout << (i+1) << " " << atom_view(history[i]) << std::endl;
+    }
+    return 0;
+  }
+
+  return 1;     
+
+}
+
+std::vector<char*> make_argv(const std::vector<std::string> & args){
+
+  std::vector<char*> out;
+  out.reserve(args.size() +  1);
+  for(auto &s : args){
+    out.push_back(const_cast<char*>(s.c_str()));
+  }
+  out.push_back(nullptr);
+  return out;
+
+}
+
+//PATH search through the command hash, empty when nothing executable is found
+static std::string resolve_command(const std::string& name){
+  if(name.find('/') != std::string::npos) return name;
+
+  auto it = command_hash.find(name);
+  if(it != command_hash.end() && access(it->second.c_str(), X_OK) == 0){
+    return it->second;
+  }
+
+  const char* path_env = var_cstr("PATH");
+  if(!path_env) return {};
+
+  for(auto& dir : split_path_env(path_env)){
+    std::string full = dir + "/" + name;
+    struct stat st;
+    if(stat(full.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(full.c_str(), X_OK) == 0){
+      command_hash[name] = full;
+      return full;
+    }
+  }
+  return {};
+}
+
+//execve, returns only when it failed
+static void exec_path(const char* path, char** argv, char** envp){
+  execve(path, argv, envp);
+
+  //a script without a #! line runs under sh, as execvp would do
+  if(errno == ENOEXEC){
+    std::vector<char*> sh_argv = { const_cast<char*>("sh"), const_cast<char*>(path) };
+    for(char** a = argv + 1; *a; ++a) sh_argv.push_back(*a);
+    sh_argv.push_back(nullptr);
+    execve("/bin/sh", sh_argv.data(), envp);
+  }
+}
+
+//child side of an external command: prefix assignments only reach its environment
+[[noreturn]] static void exec_command(const command& c){
+  for(auto& [id, value] : c.assigns){
+    var_set(id, value);
+    var_export(id);
+  }
+
+  if(!c.path.empty()){
+    auto argv = make_argv(c.argv);
+    exec_path(c.path.c_str(), argv.data(), shell_envp());
+  }
+
+  std::cerr << c.argv[0] << ": not found" << std::endl;
+  _exit(127);
+}
+
+//xargs: stdin is split into arguments that are packed straight into one buffer per
+//batch (NUL terminated, the argv pointers are made at spawn time), so the input is
+//never held as a list of strings. A batch is cut when the next argument would not fit
+//into ARG_MAX minus the environment, or at -n arguments.
+constexpr size_t XARGS_ARG_STRLEN = 32 * 4096;   //MAX_ARG_STRLEN: Linux's limit for one argument
+
+struct xargs_state {
+  std::string path;
+  std::vector<std::string> fixed;     //the command and its own arguments
+  size_t limit = 0;                   //bytes one batch may use, argv pointers included
+  size_t fixed_size = 0;
+  size_t max_args = 0;                //-n, 0 for no limit
+  size_t max_procs = 1;               //-P, 0 for no limit
+  std::string args;                   //arguments of the batch being built
+  std::vector<size_t> starts;         //where each of them begins in args
+  std::unordered_map<pid_t, int> running;   //batch -> its pidfd, -1 without pidfd_open
+  size_t spawned = 0;
+  int status = 0;
+  bool stop = false;
+};
+
+//waits for one of its own batches (never for other children of the shell) and folds
+//its status into the result the way GNU xargs reports it
+static void xargs_reap(xargs_state& x){
+  if(x.running.empty()) return;
+
+  //whichever batch finishes first, or without pidfds any one of them
+  pid_t pid = x.running.begin()->first;
+  std::vector<pollfd> pfds;
+  std::vector<pid_t> pids;
+  for(auto& [p, fd] : x.running){
+    if(fd < 0){
+      pfds.clear();
+      pid = p;
+      break;
+    }
+    pfds.push_back({fd, POLLIN, 0});
+    pids.push_back(p);
+  }
+  if(!pfds.empty()){
+    while(poll(pfds.data(), pfds.size(), -1) < 0 && errno == EINTR){}
+    for(size_t i = 0; i < pfds.size(); i++){
+      if(pfds[i].revents){
+        pid = pids[i];
+        break;
+      }
+    }
+  }
+
+  int st;
+  pid_t got;
+  while((got = waitpid(pid, &st, 0)) < 0 && errno == EINTR){}
+  auto it = x.running.find(pid);
+  if(it->second >= 0) close(it->second);
+  x.running.erase(it);
+  if(got < 0) return;
+
+  if(WIFSIGNALED(st)){
+    std::cerr << "xargs: " << x.fixed[0] << ": terminated by signal " << WTERMSIG(st) << std::endl;
+    x.status = 125;
+    x.stop = true;
+  }
+  else if(WEXITSTATUS(st) == 255){
+    std::cerr << "xargs: " << x.fixed[0] << ": exited with status 255; aborting" << std::endl;
+    x.status = 124;
+    x.stop = true;
+  }
+  else if(WEXITSTATUS(st) == 126 || WEXITSTATUS(st) == 127){
+    if(!x.status) x.status = WEXITSTATUS(st);
+  }
+  else if(WEXITSTATUS(st) != 0 && !x.status){
+    x.status = 123;
+  }
+}
+
+//spawns the first count arguments of the batch and keeps the rest for the next one
+static void xargs_spawn(xargs_state& x, size_t count){
+  while(x.max_procs && x.running.size() >= x.max_procs && !x.stop) xargs_reap(x);
+  if(x.stop) return;
+
+  std::vector<char*> argv;
+  argv.reserve(x.fixed.size() + count + 1);
+  for(auto& f : x.fixed) argv.push_back(const_cast<char*>(f.c_str()));
+  for(size_t i = 0; i < count; i++) argv.push_back(&x.args[x.starts[i]]);
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if(pid == 0){
+    //the batch's stdin would otherwise be the rest of the argument list
+    int null_fd = open("/dev/null", O_RDONLY);
+    if(null_fd >= 0){
+      dup2(null_fd, 0);
+      close(null_fd);
+    }
+    exec_path(x.path.c_str(), argv.data(), shell_envp());
+    std::cerr << "xargs: " << x.fixed[0] << ": " << strerror(errno) << std::endl;
+    _exit(errno == ENOENT ? 127 : 126);
+  }
+  if(pid < 0){
+    perror("fork");
+    x.status = 1;
+    x.stop = true;
+    return;
+  }
+  x.running.emplace(pid, (int)syscall(SYS_pidfd_open, pid, 0));
+  x.spawned++;
+
+  //the child has its own copy, so the buffer is reused right away
+  size_t keep_from = count < x.starts.size() ? x.starts[count] : x.args.size();
+  x.args.erase(0, keep_from);
+  x.starts.erase(x.starts.begin(), x.starts.begin() + count);
+  for(auto& st : x.starts) st -= keep_from;
+}
+
+//called once the argument starting at starts.back() is complete
+static void xargs_add(xargs_state& x){
+  size_t len = x.args.size() - x.starts.back();
+  x.args += '\0';
+  if(len + 1 > XARGS_ARG_STRLEN){
+    std::cerr << "xargs: argument line too long" << std::endl;
+    x.status = 1;
+    x.stop = true;
+    return;
+  }
+
+  size_t used = x.fixed_size + x.args.size() + x.starts.size() * sizeof(char*);
+  if(x.starts.size() > 1 && used > x.limit){
+    xargs_spawn(x, x.starts.size() - 1);
+  }
+  if(x.max_args && x.starts.size() == x.max_args){
+    xargs_spawn(x, x.starts.size());
+  }
+}
+
+static int run_xargs(const std::vector<std::string>& argv){
+  xargs_state x;
+  bool nul = false, no_empty = false;
+  size_t i = 1;
+  for(; i < argv.size() && argv[i].size() > 1 && argv[i][0] == '-'; i++){
+    const std::string& a = argv[i];
+    if(a == "--"){
+      i++;
+      break;
+    }
+    if(a == "-0") nul = true;
+    else if(a == "-r") no_empty = true;
+    else if((a[1] == 'n' || a[1] == 'P') && (a.size() > 2 || i + 1 < argv.size())){
+      //-n N or -nN
+      const std::string& value = a.size() > 2 ? a : argv[++i];
+      size_t skip = a.size() > 2 ? 2 : 0;
+      try{
+        size_t used = 0;
+        size_t v = std::stoul(value.substr(skip), &used);
+        if(used != value.size() - skip || value[skip] == '-') throw std::invalid_argument(value);
+        if(a[1] == 'n') x.max_args = v;
+        else x.max_procs = v;
+      }catch(...){
+        std::cerr << "xargs: invalid number for -" << a[1] << ": " << value.substr(skip) << std::endl;
+        return 1;
+      }
+    }
+    else{
+      std::cerr << "usage: xargs [-0] [-r] [-n max-args] [-P max-procs] [command [args...]]" << std::endl;
+      return 1;
+    }
+  }
+
+  x.fixed.assign(argv.begin() + i, argv.end());
+  if(x.fixed.empty()) x.fixed.push_back("echo");
+  x.path = resolve_command(x.fixed[0]);
+  if(x.path.empty()){
+    std::cerr << "xargs: " << x.fixed[0] << ": No such file or directory" << std::endl;
+    return 127;
+  }
+
+  //what execve counts against ARG_MAX: every string with its NUL plus its pointer, for
+  //argv and envp alike; 2048 bytes stay free as POSIX asks
+  long arg_max = sysconf(_SC_ARG_MAX);
+  size_t env_size = sizeof(char*);
+  for(char** e = shell_envp(); *e; ++e) env_size += strlen(*e) + 1 + sizeof(char*);
+  for(auto& f : x.fixed) x.fixed_size += f.size() + 1 + sizeof(char*);
+  x.fixed_size += sizeof(char*);
+  size_t budget = arg_max > 0 ? (size_t)arg_max : 128 * 1024;
+  if(budget < env_size + x.fixed_size + 2048 + 4096){
+    std::cerr << "xargs: environment is too large for exec" << std::endl;
+    return 1;
+  }
+  x.limit = budget - env_size - 2048;
+
+  //split like xargs: blanks and newlines separate, quotes and backslashes protect;
+  //with -0 only NUL does
+  char buf[CAPTURE_CHUNK];
+  bool in_arg = false, escaped = false;
+  char quote = 0;
+  ssize_t n;
+  while(!x.stop && (n = read(0, buf, sizeof(buf))) != 0){
+    if(n < 0){
+      if(errno == EINTR) continue;
+      perror("xargs: read");
+      x.status = 1;
+      break;
+    }
+    for(ssize_t k = 0; k < n && !x.stop; k++){
+      char ch = buf[k];
+      if(!in_arg){
+        if(!nul && (ch == ' ' || ch == '\t' || ch == '\n')) continue;
+        in_arg = true;
+        x.starts.push_back(x.args.size());
+      }
+
+      if(nul){
+        if(ch == '\0'){
+          in_arg = false;
+          xargs_add(x);
+        }
+        else x.args += ch;
+      }
+      else if(escaped){
+        x.args += ch;
+        escaped = false;
+      }
+      else if(quote){
+        if(ch == quote) quote = 0;
+        else x.args += ch;
+      }
+      else if(ch == '\\') escaped = true;
+      else if(ch == '\'' || ch == '"') quote = ch;
+      else if(ch == ' ' || ch == '\t' || ch == '\n'){
+        in_arg = false;
+        xargs_add(x);
+      }
+      else x.args += ch;
+    }
+  }
+
+  if(quote && !x.stop){
+    std::cerr << "xargs: unmatched " << (quote == '"' ? "double" : "single") << " quote" << std::endl;
+    x.status = 1;
+  }
+  else if(in_arg && !x.stop){
+    xargs_add(x);
+  }
+
+  //empty input still runs the command once, unless -r
+  if(!x.stop && (!x.starts.empty() || (!x.spawned && !no_empty))){
+    xargs_spawn(x, x.starts.size());
+  }
+  while(!x.running.empty()) xargs_reap(x);
+  return x.status;
+}
+
+int exec_node(const node& n);
+
+static void set_pipestatus(const std::vector<int>& statuses){
+  static const uint32_t id = var_intern("PIPESTATUS");
+  std::string v;
+  for(int st : statuses){
+    if(!v.empty()) v += ' ';
+    v += std::to_string(st);
+  }
+  var_set(id, std::move(v));
+}
+
+//a stage that failed on its own (not from SIGPIPE) ends the pipeline under pipekill
+static bool stage_failed(int code){
+  return code != 0 && code != 128 + SIGPIPE;
+}
+
+//zygote: a helper started by re-executing the shell binary, so its memory stays tiny
+//however large the shell grows, forks the external commands for it. Each request is
+//one SOCK_SEQPACKET message: a zygote_request, then path, argv and envp as NUL
+//terminated strings, with stdin, stdout, stderr and the cwd attached by SCM_RIGHTS.
+//The helper answers SPAWNED with the child's pidfd attached (no pid reuse race) and
+//later EXITED with its wait status.
+constexpr size_t ZYGOTE_MSG_MAX = 192 * 1024;   //below the default socket buffer limit
+constexpr int ZYGOTE_FDS = 4;
+
+struct zygote_request {
+  uint32_t argc;
+  uint32_t envc;
+};
+
+struct zygote_reply {
+  enum : int32_t { SPAWNED = 1, EXITED = 2, FAILED = 3 } kind;
+  int32_t pid;
+  int32_t status;   //raw wait status for EXITED, errno for FAILED
+};
+
+static int zygote_sock = -1;
+static pid_t zygote_pid = -1;
+static pid_t zygote_owner = -1;   //the process the socket belongs to, forked stages fork locally
+static std::unordered_map<pid_t, int> zygote_pidfds;     //running children, pidfd owned here
+static std::unordered_map<pid_t, int> zygote_statuses;   //EXITED replies not asked for yet
+
+static bool send_with_fds(int sock, const void* data, size_t len, const int* fds, int nfds){
+  iovec iov{const_cast<void*>(data), len};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if(nfds > 0){
+    memset(ctl, 0, sizeof(ctl));
+    msg.msg_control = ctl;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsghdr* c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+  }
+  ssize_t n;
+  while((n = sendmsg(sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR){}
+  return n == (ssize_t)len;
+}
+
+//one message and up to max fds; returns its length, 0 at EOF, -1 on errors
+static ssize_t recv_with_fds(int sock, void* data, size_t len, int* fds, int max, int& nfds){
+  iovec iov{data, len};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(int) * ZYGOTE_FDS)];
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  ssize_t n;
+  while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR){}
+
+  nfds = 0;
+  if(n < 0) return n;
+  for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+    if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for(int i = 0; i < count; i++){
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if(nfds < max) fds[nfds++] = fd;
+      else close(fd);
+    }
+  }
+  if(msg.msg_flags & MSG_TRUNC) return -1;
+  return n;
+}
+
+//the helper's main loop: requests and child exits, both through one epoll set
+[[noreturn]] static void run_zygote(int sock){
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  //terminal signals are meant for the commands, not for the helper
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTSTP, SIG_IGN);
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.u64 = UINT64_MAX;
+  epoll_ctl(ep, EPOLL_CTL_ADD, sock, &ev);
+
+  std::unordered_map<int, pid_t> children;   //pidfd -> pid
+  std::vector<pid_t> polled;                 //children pidfd_open failed for
+  std::vector<char> buf(ZYGOTE_MSG_MAX);
+  while(true){
+    epoll_event evs[32];
+    int k = epoll_wait(ep, evs, 32, polled.empty() ? -1 : 10);
+    if(k < 0 && errno != EINTR) _exit(1);
+
+    for(size_t i = 0; i < polled.size();){
+      int st = 0;
+      if(waitpid(polled[i], &st, WNOHANG) == polled[i]){
+        zygote_reply r{zygote_reply::EXITED, polled[i], st};
+        send_with_fds(sock, &r, sizeof(r), nullptr, 0);
+        polled[i] = polled.back();
+        polled.pop_back();
+      }
+      else i++;
+    }
+
+    for(int e = 0; e < k; e++){
+      if(evs[e].data.u64 != UINT64_MAX){
+        int pfd = (int)evs[e].data.u64;
+        pid_t pid = children[pfd];
+        int st = 0;
+        while(waitpid(pid, &st, 0) < 0 && errno == EINTR){}
+        epoll_ctl(ep, EPOLL_CTL_DEL, pfd, nullptr);
+        close(pfd);
+        children.erase(pfd);
+        zygote_reply r{zygote_reply::EXITED, pid, st};
+        send_with_fds(sock, &r, sizeof(r), nullptr, 0);
+        continue;
+      }
+
+      int fds[ZYGOTE_FDS];
+      int nfds = 0;
+      ssize_t n = recv_with_fds(sock, buf.data(), buf.size(), fds, ZYGOTE_FDS, nfds);
+      if(n == 0) _exit(0);   //the shell is gone
+
+      //path, argv and envp point straight into the message
+      zygote_request req{};
+      std::vector<char*> strs;
+      if(n >= (ssize_t)sizeof(req)){
+        memcpy(&req, buf.data(), sizeof(req));
+        char* p = buf.data() + sizeof(req);
+        char* end = buf.data() + n;
+        while(p < end){
+          char* nul = (char*)memchr(p, '\0', end - p);
+          if(!nul) break;
+          strs.push_back(p);
+          p = nul + 1;
+        }
+      }
+      if(nfds != ZYGOTE_FDS || req.argc == 0 || strs.size() != 1 + (size_t)req.argc + req.envc){
+        for(int i = 0; i < nfds; i++) close(fds[i]);
+        zygote_reply r{zygote_reply::FAILED, 0, EINVAL};
+        send_with_fds(sock, &r, sizeof(r), nullptr, 0);
+        continue;
+      }
+      std::vector<char*> argv(strs.begin() + 1, strs.begin() + 1 + req.argc);
+      argv.push_back(nullptr);
+      std::vector<char*> envp(strs.begin() + 1 + req.argc, strs.end());
+      envp.push_back(nullptr);
+
+      pid_t pid = fork();
+      if(pid == 0){
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        for(int i = 0; i < 3; i++) dup2(fds[i], i);
+        if(fchdir(fds[3]) < 0) perror("cd");
+        exec_path(strs[0], argv.data(), envp.data());
+        std::cerr << argv[0] << ": not found" << std::endl;
+        _exit(127);
+      }
+      for(int i = 0; i < nfds; i++) close(fds[i]);
+
+      if(pid < 0){
+        zygote_reply r{zygote_reply::FAILED, 0, errno};
+        send_with_fds(sock, &r, sizeof(r), nullptr, 0);
+        continue;
+      }
+
+      //the command is running: without a pidfd it is still SPAWNED, just polled for
+      int pfd = (int)syscall(SYS_pidfd_open, pid, 0);
+      if(pfd < 0){
+        polled.push_back(pid);
+        zygote_reply r{zygote_reply::SPAWNED, pid, 0};
+        send_with_fds(sock, &r, sizeof(r), nullptr, 0);
+        continue;
+      }
+      ev.data.u64 = (uint64_t)pfd;
+      epoll_ctl(ep, EPOLL_CTL_ADD, pfd, &ev);
+      children[pfd] = pid;
+      zygote_reply r{zygote_reply::SPAWNED, pid, 0};
+      send_with_fds(sock, &r, sizeof(r), &pfd, 1);
+    }
+  }
+}
+
+static void zygote_stop(){
+  if(zygote_sock < 0) return;
+  close(zygote_sock);
+  zygote_sock = -1;
+  waitpid(zygote_pid, nullptr, 0);
+  zygote_pid = -1;
+}
+
+//starts the helper by re-executing /proc/self/exe, false when that is not possible
+static bool zygote_start(){
+  if(zygote_sock >= 0) return zygote_owner == getpid();
+
+  int self_pidfd = (int)syscall(SYS_pidfd_open, getpid(), 0);
+  if(self_pidfd < 0){
+    std::cerr << "zygote: needs pidfd support, starting commands directly" << std::endl;
+    opt_zygote = false;
+    return false;
+  }
+  close(self_pidfd);
+
+  int sv[2];
+  if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0){
+    perror("zygote: socketpair");
+    opt_zygote = false;
+    return false;
+  }
+
+  pid_t pid = fork();
+  if(pid == 0){
+    //fd 3 without O_CLOEXEC survives the exec. Nothing else may: a lazy start happens
+    //while a pipeline's pipes are open, and a write end kept here would hold off EOF
+    if(dup2(sv[1], 3) < 0) _exit(1);
+    int null_fd = open("/dev/null", O_RDONLY);
+    if(null_fd >= 0){
+      dup2(null_fd, 0);
+      if(null_fd != 0) close(null_fd);
+    }
+    syscall(SYS_close_range, 4, ~0U, 0);
+    char* argv[] = {const_cast<char*>("shell"), const_cast<char*>("--zygote-helper"), nullptr};
+    char* envp[] = {nullptr};
+    execve("/proc/self/exe", argv, envp);
+    _exit(127);
+  }
+  close(sv[1]);
+  if(pid < 0){
+    perror("zygote: fork");
+    close(sv[0]);
+    opt_zygote = false;
+    return false;
+  }
+  zygote_sock = sv[0];
+  zygote_pid = pid;
+  zygote_owner = getpid();
+  return true;
+}
+
+//reads one reply, parking EXITED ones in zygote_statuses; false if the helper died
+static bool zygote_read_reply(zygote_reply& r){
+  int fd = -1, nfds = 0;
+  ssize_t n = recv_with_fds(zygote_sock, &r, sizeof(r), &fd, 1, nfds);
+  if(n != (ssize_t)sizeof(r)){
+    if(nfds) close(fd);
+    std::cerr << "zygote: helper exited, starting commands directly" << std::endl;
+    zygote_stop();
+    return false;
+  }
+  if(r.kind == zygote_reply::EXITED){
+    zygote_statuses[r.pid] = r.status;
+  }
+  else if(r.kind == zygote_reply::SPAWNED){
+    zygote_pidfds[r.pid] = nfds ? fd : -1;
+  }
+  return true;
+}
 
-          //path lookup
+//prefix assignments change the environment of the child alone, so those commands are
+//still forked here
+static bool zygote_eligible(const command& c){
+  return opt_zygote && !c.path.empty() && c.assigns.empty();
+}
 
-          for(const auto& dir : dirs){
-          std::string fullPath = dir + "/" + argv[1];
+//hands an external command to the helper with the given stdin and stdout; the pid, or
+//-1 when the command has to be forked here instead
+static pid_t zygote_spawn(const command& c, int in, int out){
+  if(!zygote_eligible(c) || !zygote_start()) return -1;
+
+  std::string msg(sizeof(zygote_request), '\0');
+  zygote_request req{(uint32_t)c.argv.size(), 0};
+  msg += c.path;
+  msg += '\0';
+  for(auto& a : c.argv){
+    msg += a;
+    msg += '\0';
+  }
+  for(char** e = shell_envp(); *e; ++e){
+    msg.append(*e);
+    msg += '\0';
+    req.envc++;
+  }
+  if(msg.size() > ZYGOTE_MSG_MAX) return -1;
+  memcpy(&msg[0], &req, sizeof(req));
+
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if(cwd < 0) return -1;
+  int fds[ZYGOTE_FDS] = {in, out, 2, cwd};
+  bool sent = send_with_fds(zygote_sock, msg.data(), msg.size(), fds, ZYGOTE_FDS);
+  close(cwd);
+  if(!sent){
+    zygote_stop();
+    return -1;
+  }
 
-            if(access(fullPath.c_str(), F_OK) != 0){
-              continue;
-            }
+  zygote_reply r;
+  do{
+    if(!zygote_read_reply(r)) return -1;
+  }while(r.kind == zygote_reply::EXITED);
+  return r.kind == zygote_reply::SPAWNED ? r.pid : -1;
+}
 
-            if(access(fullPath.c_str(), X_OK) != 0){
-              continue;
-            }
+static bool is_zygote_child(pid_t pid){
+  return zygote_pidfds.count(pid) != 0;
+}
 
-            std::cout << argv[1] << " is " << fullPath << std::endl;    
-            return 0;
-          }
+//takes the child's pidfd, so waiting on it needs no pidfd_open on a pid the helper reaps
+static int zygote_take_pidfd(pid_t pid){
+  auto it = zygote_pidfds.find(pid);
+  int fd = it->second;
+  it->second = -1;
+  return fd;
+}
 
-                
-    std::cout << argv[1] << ": not found" << std::endl;
-    return 1;
-                
+//the raw wait status of a child started by the helper
+static int zygote_wait(pid_t pid){
+  int st = 1 << 8;   //lost with the helper: reported as status 1
+  zygote_reply r;
+  while(!zygote_statuses.count(pid) && zygote_sock >= 0 && zygote_read_reply(r)){}
+  auto done = zygote_statuses.find(pid);
+  if(done != zygote_statuses.end()){
+    st = done->second;
+    zygote_statuses.erase(done);
   }
-     
-  
-  else if (cmd == "history"){
+  auto it = zygote_pidfds.find(pid);
+  if(it != zygote_pidfds.end()){
+    if(it->second >= 0) close(it->second);
+    zygote_pidfds.erase(it);
+  }
+  return st;
+}
 
-    if(argv.size() == 3 && argv[1] == "-a"){
-      if(!history_append_file(argv[2], session_start_index)){
-        std::cerr << "history: failed to append file" << std::endl;
-        return 1;
+//waitpid() for pipeline stages, whichever process started them
+static void reap_stage(pid_t pid, int* st){
+  if(is_zygote_child(pid)){
+    *st = zygote_wait(pid);
+    return;
+  }
+  while(waitpid(pid, st, 0) < 0 && errno == EINTR){}
+}
+
+//reaps the stages in the order they finish, using a pidfd per stage in one epoll set;
+//falls back to waiting in launch order on kernels without pidfd_open
+static std::vector<int> wait_pipeline(const std::vector<pid_t>& pids){
+  size_t n = pids.size();
+  std::vector<int> statuses(n, 0);
+  std::vector<int> pidfds(n, -1);
+  size_t remaining = n;
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  for(size_t i = 0; i < n && ep >= 0; i++){
+    pidfds[i] = is_zygote_child(pids[i]) ? zygote_take_pidfd(pids[i])
+                                         : (int)syscall(SYS_pidfd_open, pids[i], 0);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = i;
+    if(pidfds[i] < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, pidfds[i], &ev) < 0){
+      for(auto& fd : pidfds){
+        if(fd >= 0) close(fd);
+        fd = -1;
       }
-      session_start_index = history.size();
-      return 0;
+      close(ep);
+      ep = -1;
     }
+  }
 
-    if(argv.size() == 3 && argv[1] == "-w"){
-      if(!history_write_file(argv[2])){
-        std::cerr << "history: failed to write file" << std::endl;
-        return 1;
+  auto reaped = [&](size_t i, int st){
+    statuses[i] = status_code(st);
+    remaining--;
+    if(!opt_pipekill || !stage_failed(statuses[i])) return;
+
+    for(size_t j = 0; j < n; j++){
+      if(pidfds[j] >= 0){
+        syscall(SYS_pidfd_send_signal, pidfds[j], SIGPIPE, nullptr, 0);
+      }
+      else if(ep < 0 && j > i){
+        kill(pids[j], SIGPIPE);
       }
-      session_start_index = history.size();
-      return 0;
     }
+  };
 
-    if(argv.size() ==  3 && argv[1] == "-r"){
-      size_t added = history_read_file(argv[2]);
+  if(ep < 0){
+    for(size_t i = 0; i < n; i++){
+      int st = 0;
+      reap_stage(pids[i], &st);
+      reaped(i, st);
+    }
+    return statuses;
+  }
 
-      size_t start = (added <= history.size()) ? (history.size() - added) : 0;
-      for (size_t i = start; i < history.size(); ++i){
-        add_history(history[i].c_str());
-      }
+  while(remaining > 0){
+    epoll_event evs[16];
+    int k = epoll_wait(ep, evs, 16, -1);
+    if(k < 0){
+      if(errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
 
-      session_start_index = history.size();
-      return 0;
+    for(int e = 0; e < k; e++){
+      size_t i = (size_t)evs[e].data.u64;
+      int st = 0;
+      reap_stage(pids[i], &st);
+      epoll_ctl(ep, EPOLL_CTL_DEL, pidfds[i], nullptr);
+      close(pidfds[i]);
+      pidfds[i] = -1;
+      reaped(i, st);
     }
+  }
 
-    if(argv.size() == 2 && argv[1] == "-c"){
-      history.clear();
-      clear_history();
-      std::ofstream(HISTFILE, std::ios::trunc).close();
-      session_start_index = 0;
-      return 0;
+  //only reached if epoll_wait failed
+  for(size_t i = 0; i < n; i++){
+    if(pidfds[i] >= 0){
+      int st = 0;
+      reap_stage(pids[i], &st);
+      close(pidfds[i]);
+      statuses[i] = status_code(st);
     }
+  }
+  close(ep);
+  return statuses;
+}
 
-    size_t start = 0;
-    if(argv.size() == 2){
-      try{
-        int n = std::stoi(argv[1]);
-        if(n < 0) n=0;
-        if((size_t)n < history.size()) start = history.size() - (size_t)n;
-      }catch(...){
+//calls a shell function with argv[1..] as its positional parameters
+static int run_function(const node& body, const std::vector<std::string>& argv){
+  if(call_stack.size() >= FUNC_MAX_DEPTH){
+    std::cerr << argv[0] << ": maximum function nesting level exceeded" << std::endl;
+    return 1;
+  }
+
+  call_stack.push_back({std::vector<std::string>(argv.begin() + 1, argv.end()), {}});
+  int saved_depth = loop_depth;
+  loop_depth = 0;   //break and continue do not reach loops of the caller
+
+  int st = exec_node(body);
+  if(func_returning){
+    func_returning = false;
+    st = return_status;
+  }
+
+  loop_depth = saved_depth;
+  auto& locals = call_stack.back().locals;
+  for(auto it = locals.rbegin(); it != locals.rend(); ++it){
+    var_changed(it->first);
+    vars[it->first] = std::move(it->second);
+    var_changed(it->first);
+  }
+  call_stack.pop_back();
+  return st;
+}
+
+//PIPEPIN=compact|spread|numa places the stages of a pipeline. The topology comes from
+//sysfs once, restricted to the CPUs the shell itself may use.
+//  compact: one CPU per stage, consecutive stages on consecutive CPUs of the same L3
+//           domain, so a pipe's writer and reader share a cache. A pipeline never
+//           straddles two domains: it moves on to the next domain with room for all
+//           its stages, and one longer than any domain wraps inside its domain
+//  spread:  stage i may use all CPUs of L3 domain i, round robin over the domains
+//  numa:    the whole pipeline on the CPUs of one node, which is also its preferred
+//           memory node
+//Each pipeline starts where the previous one stopped, so concurrent pipelines do not
+//all land on the first CPUs.
+struct cpu_topology {
+  std::vector<std::vector<int>> l3;                       //allowed CPUs by shared L3
+  std::vector<std::pair<int, std::vector<int>>> nodes;    //NUMA node and its allowed CPUs
+  std::vector<int> compact_order;                         //l3 domains one after the other
+};
+
+struct stage_pin {
+  cpu_set_t cpus;
+  int node = -1;   //preferred memory node, -1 to leave the policy alone
+};
+
+//"0-3,8,10-11" as in cpulist files
+static std::vector<int> parse_cpulist(const std::string& list){
+  std::vector<int> cpus;
+  size_t i = 0;
+  while(i < list.size()){
+    size_t j = list.find(',', i);
+    std::string part = list.substr(i, j == std::string::npos ? std::string::npos : j - i);
+    size_t dash = part.find('-');
+    try{
+      int lo = std::stoi(part.substr(0, dash));
+      int hi = dash == std::string::npos ? lo : std::stoi(part.substr(dash + 1));
+      for(int c = lo; c <= hi; c++) cpus.push_back(c);
+    }catch(...){
+      //a trailing newline or an empty list
+    }
+    if(j == std::string::npos) break;
+    i = j + 1;
+  }
+  return cpus;
+}
+
+static std::string read_sysfs_line(const std::string& path){
+  std::ifstream in(path);
+  std::string line;
+  std::getline(in, line);
+  return line;
+}
 
+static const cpu_topology& topology(){
+  static cpu_topology topo;
+  static bool loaded = false;
+  if(loaded) return topo;
+  loaded = true;
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return topo;
+  auto usable = [&](int c){ return c >= 0 && c < CPU_SETSIZE && CPU_ISSET(c, &allowed); };
+
+  //the highest cache level listed for a CPU is its L3 (or whatever its last level is)
+  std::vector<bool> placed(CPU_SETSIZE, false);
+  for(int c = 0; c < CPU_SETSIZE; c++){
+    if(!usable(c) || placed[c]) continue;
+    std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(c) + "/cache/index";
+    std::string shared;
+    for(int idx = 0; idx < 8; idx++){
+      std::string line = read_sysfs_line(base + std::to_string(idx) + "/shared_cpu_list");
+      if(line.empty()) break;
+      shared = line;
+    }
+    std::vector<int> domain;
+    for(int o : parse_cpulist(shared)){
+      if(usable(o) && !placed[o]){
+        placed[o] = true;
+        domain.push_back(o);
       }
     }
+    if(!placed[c]){
+      placed[c] = true;
+      domain.insert(domain.begin(), c);
+    }
+    topo.l3.push_back(std::move(domain));
+  }
+  for(auto& d : topo.l3){
+    topo.compact_order.insert(topo.compact_order.end(), d.begin(), d.end());
+  }
 
-    for (size_t i = start; i < history.size(); ++i){
-      std::cout << (i+1) << " " << history[i] << std::endl;
+  //node ids can have gaps, so every nodeN directory is looked at
+  std::error_code ec;
+  for(auto& e : fs::directory_iterator("/sys/devices/system/node", ec)){
+    std::string name = e.path().filename().string();
+    if(name.size() < 5 || name.compare(0, 4, "node") != 0) continue;
+    int node = 0;
+    auto [end, err] = std::from_chars(name.data() + 4, name.data() + name.size(), node);
+    if(err != std::errc() || end != name.data() + name.size() || node >= 1024) continue;
+
+    std::vector<int> cpus;
+    for(int c : parse_cpulist(read_sysfs_line(e.path().string() + "/cpulist"))){
+      if(usable(c)) cpus.push_back(c);
     }
-    return 0;
+    if(!cpus.empty()) topo.nodes.emplace_back(node, std::move(cpus));
   }
+  std::sort(topo.nodes.begin(), topo.nodes.end());
+  return topo;
+}
 
-  return 1;     
+static size_t pipepin_next = 0;   //rotates between pipelines
 
-}
+//placement for the n stages of the next pipeline, empty when PIPEPIN is unset
+static std::vector<stage_pin> plan_pipeline_pins(int n){
+  const char* policy = var_cstr("PIPEPIN");
+  if(!policy || !*policy) return {};
 
-std::vector<char*> make_argv(const std::vector<std::string> & args){
+  std::string_view p = policy;
+  if(p != "compact" && p != "spread" && p != "numa"){
+    std::cerr << "PIPEPIN: " << p << ": unknown policy (compact, spread or numa)" << std::endl;
+    return {};
+  }
 
-  std::vector<char*> out;
-  out.reserve(args.size() +  1);
-  for(auto &s : args){
-    out.push_back(const_cast<char*>(s.c_str()));
+  const cpu_topology& topo = topology();
+  if(topo.compact_order.empty()) return {};
+
+  size_t& next = pipepin_next;
+  std::vector<stage_pin> pins(n);
+  for(auto& pin : pins) CPU_ZERO(&pin.cpus);
+
+  if(p == "compact"){
+    //next is a position in compact_order; find its domain and where that domain starts
+    size_t total = topo.compact_order.size();
+    next %= total;
+    size_t d = 0, start = 0;
+    while(next >= start + topo.l3[d].size()) start += topo.l3[d++].size();
+
+    //not enough room left: the start of the next domain that can hold every stage
+    if(next + n > start + topo.l3[d].size()){
+      size_t dd = d, s = start;
+      for(size_t k = 0; k < topo.l3.size(); k++){
+        s += topo.l3[dd].size();
+        if(++dd == topo.l3.size()){
+          dd = 0;
+          s = 0;
+        }
+        if(topo.l3[dd].size() >= (size_t)n) break;
+      }
+      if(topo.l3[dd].size() >= (size_t)n){
+        d = dd;
+        start = s;
+      }
+      next = start;
+    }
+
+    //longer than any domain: the stages wrap around inside it
+    size_t size = topo.l3[d].size();
+    for(int i = 0; i < n; i++){
+      CPU_SET(topo.l3[d][(next - start + i) % size], &pins[i].cpus);
+    }
+    next = start + std::min(next - start + n, size);
   }
-  out.push_back(nullptr);
-  return out;
+  else if(p == "spread"){
+    for(int i = 0; i < n; i++){
+      for(int c : topo.l3[(next + i) % topo.l3.size()]) CPU_SET(c, &pins[i].cpus);
+    }
+    next = (next + n) % topo.l3.size();
+  }
+  else{
+    if(topo.nodes.empty()) return {};
+    auto& [node, cpus] = topo.nodes[next++ % topo.nodes.size()];
+    for(auto& pin : pins){
+      for(int c : cpus) CPU_SET(c, &pin.cpus);
+      pin.node = node;
+    }
+  }
+  return pins;
+}
 
+//child side, before exec: failures only cost the placement, never the command
+static void apply_stage_pin(const stage_pin& pin){
+  sched_setaffinity(0, sizeof(pin.cpus), &pin.cpus);
+  if(pin.node >= 0){
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {};
+    mask[pin.node / (8 * sizeof(unsigned long))] |= 1UL << (pin.node % (8 * sizeof(unsigned long)));
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, 1024);
+  }
 }
 
 int execute_pipeline(const std::vector<command>& cmds){
@@ -808,8 +4516,20 @@ int execute_pipeline(const std::vector<command>& cmds){
   std::vector<pid_t> pids;
   pids.reserve(n);
 
+  std::vector<stage_pin> pins = plan_pipeline_pins(n);
+
   for(int i =0 ; i < n ; i++){
-    
+
+    //plain external stages go to the zygote; redirections and placement need a fork here
+    if(pins.empty() && cmds[i].redirs.empty() && !cmds[i].body && !cmds[i].fn &&
+       !cmds[i].is_builtin && zygote_eligible(cmds[i])){
+      pid_t zp = zygote_spawn(cmds[i], i > 0 ? pipes[i-1][0] : 0, i < n-1 ? pipes[i][1] : 1);
+      if(zp > 0){
+        pids.push_back(zp);
+        continue;
+      }
+    }
+
     pid_t pid = fork();
 
     if(pid < 0){
@@ -819,6 +4539,8 @@ int execute_pipeline(const std::vector<command>& cmds){
   
 
     if(pid == 0){
+      if(!pins.empty()) apply_stage_pin(pins[i]);
+
       if(i > 0){
         if(dup2(pipes[i-1][0], 0) < 0){
           perror("dup2 stdin");
@@ -841,44 +4563,426 @@ int execute_pipeline(const std::vector<command>& cmds){
 
       if(!RD_apply(cmds[i].redirs, true)) _exit(1);
 
-      if(cmds[i].is_builtin){
-          int st = run_builtin(cmds[i].argv, true);
-          _exit(st);
+      if(cmds[i].body){
+        _exit(exec_node(*cmds[i].body));
+      }
+
+      for(auto& [id, value] : cmds[i].assigns){
+        var_set(id, value);
+        var_export(id);
+      }
+
+      if(cmds[i].fn){
+        _exit(run_function(*cmds[i].fn, cmds[i].argv));
+      }
+
+      if(cmds[i].argv.empty()){
+        _exit(0);
+      }
+
+      if(cmds[i].is_builtin){
+          int st = run_builtin(cmds[i].argv, true);
+          _exit(st);
+      }
+      else{
+          exec_command(cmds[i]);
+      }
+    }
+    
+    pids.push_back(pid);
+
+  }
+
+  for(int i = 0 ; i < n-1 ; i++){
+    close(pipes[i][0]);
+    close(pipes[i][1]);
+  }
+
+  std::vector<int> statuses = wait_pipeline(pids);
+  set_pipestatus(statuses);
+
+  int result = statuses.back();
+  if(opt_pipefail){
+    for(int st : statuses){
+      if(st != 0) result = st;
+    }
+  }
+  return result;
+
+}
+
+//expands a SIMPLE node into a runnable command: assignments, argv, redirection targets
+//and what argv[0] refers to (function, builtin or executable)
+static void instantiate(const node& n, command& c){
+  c.assigns.clear();
+  for(auto& [id, plan] : n.assigns){
+    c.assigns.emplace_back(id, expand_plan_string(plan));
+  }
+
+  c.argv.clear();
+  for(auto& w : n.words){
+    expand_plan(w, c.argv);
+  }
+
+  c.redirs = n.cmd.redirs;
+  if(!c.redirs.empty()) RD_expand(c.redirs);
+
+  c.fn.reset();
+  c.is_builtin = false;
+  c.path.clear();
+  if(c.argv.empty()) return;
+
+  auto f = functions.find(c.argv[0]);
+  if(f != functions.end()){
+    c.fn = f->second;
+  }
+  else if(is_Builtin(c.argv[0]) || (opt_fastutils && fastutil_applies(c.argv))){
+    c.is_builtin = true;
+  }
+  else{
+    c.path = resolve_command(c.argv[0]);
+  }
+}
+
+//runs a simple command: functions and builtins in the shell, everything else in a child
+static int run_simple(const node& n){
+  command c;
+  subst_status = -1;
+  instantiate(n, c);
+
+  //without a command the status is that of the last substitution
+  if(c.argv.empty()){
+    int st = std::max(subst_status, 0);
+    for(auto& [id, value] : c.assigns){
+      var_set(id, std::move(value));
+    }
+    FDSave saved = save_FD();
+    bool ok = RD_apply(c.redirs, false);
+    restorFD(saved);
+    return ok ? st : 1;
+  }
+
+  if (c.is_builtin || c.fn){
+    //the common case of no redirections skips saving and restoring the fds
+    bool redirected = !c.redirs.empty();
+    FDSave saved{};
+    if(redirected){
+      saved = save_FD();
+      if(!RD_apply(c.redirs,false)) {
+        restorFD(saved);
+        return 1;
+      }
+    }
+
+    if(c.is_builtin && c.argv[0] ==  "exit"){
+      if(redirected) restorFD(saved);
+      shell_exit_requested = true;
+      shell_exit_status = last_status;
+      if(c.argv.size() > 1){
+        try{
+          shell_exit_status = std::stoi(c.argv[1]) & 0xff;
+        }catch(...){
+          std::cerr << "exit: " << c.argv[1] << ": numeric argument required" << std::endl;
+          shell_exit_status = 2;
+        }
+      }
+      return shell_exit_status;
+    }
+
+    //prefix assignments are exported for the command's duration only
+    std::vector<std::pair<uint32_t, shell_var>> shadowed;
+    for(auto& [id, value] : c.assigns){
+      shadowed.emplace_back(id, vars[id]);
+      var_set(id, value);
+      var_export(id);
+    }
+
+    int st = c.fn ? run_function(*c.fn, c.argv) : run_builtin(c.argv, false);
+
+    for(auto it = shadowed.rbegin(); it != shadowed.rend(); ++it){
+      var_changed(it->first);
+      vars[it->first] = std::move(it->second);
+      var_changed(it->first);
+    }
+    if(redirected) restorFD(saved);
+    return st;
+  }
+
+  //under the zygote the redirections are applied here and passed along as fds 0-2
+  if(zygote_eligible(c)){
+    bool redirected = !c.redirs.empty();
+    FDSave saved{};
+    if(redirected){
+      saved = save_FD();
+      if(!RD_apply(c.redirs,false)) {
+        restorFD(saved);
+        return 1;
+      }
+    }
+    pid_t zp = zygote_spawn(c, 0, 1);
+    if(redirected) restorFD(saved);
+    if(zp > 0) return status_code(zygote_wait(zp));
+  }
+
+  pid_t pid = fork();
+  if(pid < 0){
+    perror("fork");
+    return 1;
+  }
+
+  if(pid == 0) {
+    if(!RD_apply(c.redirs,true)){
+      _exit(1);
+    }
+    exec_command(c);
+  }
+
+  int status = 0;
+  while(waitpid(pid, &status, 0) < 0 && errno == EINTR){}
+  return status_code(status);
+}
+
+//runs body with the redirections of a ( ) or { } applied around it
+template <typename F>
+static int with_redirs(const node& n, F body){
+  if(n.redirs.empty()) return body();
+
+  std::vector<Redirection> redirs = n.redirs;
+  RD_expand(redirs);
+
+  FDSave saved = save_FD();
+  if(!RD_apply(redirs, false)){
+    restorFD(saved);
+    return 1;
+  }
+  int st = body();
+  restorFD(saved);
+  return st;
+}
+
+//true when the body can reach state run_subshell does not put back: the history list and
+//HISTFILE, through the history builtin directly, via builtin, or in a function it calls,
+//or a command whose name is only known at run time
+static bool subshell_needs_fork(const node& n, std::unordered_set<const node*>& seen){
+  if(!seen.insert(&n).second) return false;
+
+  if(n.kind == node::SIMPLE && !n.words.empty()){
+    const word_plan& w = n.words[0];
+    if(w.kind != word_plan::LITERAL) return true;
+    if(w.text == "history") return true;
+    if(w.text == "builtin" && (n.words.size() < 2 || n.words[1].kind != word_plan::LITERAL ||
+                               n.words[1].text == "history")) return true;
+    auto f = functions.find(w.text);
+    if(f != functions.end() && subshell_needs_fork(*f->second, seen)) return true;
+  }
+  if(n.fn && subshell_needs_fork(*n.fn, seen)) return true;
+  for(auto& k : n.kids){
+    if(subshell_needs_fork(*k, seen)) return true;
+  }
+  return false;
+}
+
+//( list ) that has to be a real child
+static int run_subshell_forked(const node& n){
+  pid_t pid = fork();
+  if(pid < 0){
+    perror("fork");
+    return 1;
+  }
+  if(pid == 0){
+    int st = 1;
+    try{
+      st = with_redirs(n, [&]{ return exec_node(*n.kids[0]); });
+      if(shell_exit_requested) st = shell_exit_status;
+      else if(func_returning) st = return_status;
+    }
+    catch(const std::exception& e){
+      std::cerr << e.what() << std::endl;
+    }
+    std::cout.flush();
+    _exit(st);
+  }
+  int st = 0;
+  while(waitpid(pid, &st, 0) < 0 && errno == EINTR){}
+  return status_code(st);
+}
+
+//( list ) runs without forking: the state a subshell could change (variables, functions,
+//positional parameters, cwd, options, PIPEPIN rotation, a zygote started inside, exit)
+//is saved and put back afterwards. Bodies that could touch history fork instead.
+static int run_subshell(const node& n){
+  std::unordered_set<const node*> seen;
+  if(subshell_needs_fork(*n.kids[0], seen)) return run_subshell_forked(n);
+
+  size_t saved_pipepin = pipepin_next;
+  bool had_zygote = zygote_sock >= 0;
+  bool saved_options[std::size(shell_options)];
+  for(size_t i = 0; i < std::size(shell_options); i++) saved_options[i] = *shell_options[i].second;
+  std::vector<shell_var> saved_vars = vars;
+  auto saved_functions = functions;
+  std::vector<call_frame> saved_calls = call_stack;
+  std::string saved_path = var_cstr("PATH") ? var_cstr("PATH") : "";
+  int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  int st = with_redirs(n, [&]{ return exec_node(*n.kids[0]); });
+  if(shell_exit_requested){
+    st = shell_exit_status;
+    shell_exit_requested = false;
+    shell_exit_status = 0;
+  }
+  //break, continue and return end the subshell, not the loop or function around it
+  loop_break = 0;
+  loop_continue = 0;
+  if(func_returning){
+    func_returning = false;
+    st = return_status;
+  }
+  for(size_t i = 0; i < std::size(shell_options); i++) *shell_options[i].second = saved_options[i];
+  pipepin_next = saved_pipepin;
+  if(!had_zygote) zygote_stop();
+
+  if(cwd >= 0){
+    if(fchdir(cwd) < 0) perror("cd");
+    close(cwd);
+  }
+
+  const char* path_now = var_cstr("PATH");
+  if(saved_path != (path_now ? path_now : "")) command_hash.clear();
+
+  //names interned inside the subshell keep their ids but lose their values
+  saved_vars.resize(vars.size());
+  vars = std::move(saved_vars);
+  env_dirty = true;
+  functions = std::move(saved_functions);
+  call_stack = std::move(saved_calls);
+  return st;
+}
+
+static int exec_kind(const node& n);
+
+//after a loop's condition or body left a break, continue, return or exit pending:
+//true when this loop has to stop, false when it goes on with its next iteration
+static bool loop_should_stop(){
+  if(loop_break){
+    loop_break--;
+    return true;
+  }
+  if(loop_continue){
+    return --loop_continue > 0;
+  }
+  return true;
+}
+
+//every command updates $?
+int exec_node(const node& n){
+  last_status = exec_kind(n);
+  return last_status;
+}
+
+static int exec_kind(const node& n){
+  switch(n.kind){
+
+    case node::SIMPLE: {
+      int st = run_simple(n);
+      set_pipestatus({st});
+      return st;
+    }
+
+    case node::PIPELINE: {
+      std::vector<command> cmds(n.kids.size());
+      for(size_t i = 0; i < n.kids.size(); i++){
+        if(n.kids[i]->kind == node::SIMPLE){
+          instantiate(*n.kids[i], cmds[i]);
+        }
+        else{
+          cmds[i].body = n.kids[i].get();
+        }
+      }
+      return execute_pipeline(cmds);
+    }
+
+    case node::AND:
+    case node::OR: {
+      int st = exec_node(*n.kids[0]);
+      if(!ctl_pending() && (st == 0) == (n.kind == node::AND)){
+        st = exec_node(*n.kids[1]);
       }
-      else{
-         auto argv = make_argv(cmds[i].argv);
-          execvp(argv[0], argv.data());
-          std::cerr << cmds[i].argv[0] << ": not found " << std::endl;
-          _exit(127);
+      return st;
+    }
+
+    case node::LIST: {
+      int st = 0;
+      for(auto& k : n.kids){
+        st = exec_node(*k);
+        if(ctl_pending()) break;
       }
+      return st;
     }
-    
-    pids.push_back(pid);
 
-  }
+    case node::GROUP:
+      return with_redirs(n, [&]{ return exec_node(*n.kids[0]); });
 
-  for(int i = 0 ; i < n-1 ; i++){
-    close(pipes[i][0]);
-    close(pipes[i][1]);
-  }
+    case node::SUBSHELL:
+      return run_subshell(n);
 
-  int last_status = 0;
-  for(int i = 0 ; i < n ; i++){
-    int st =0 ;
-    waitpid(pids[i], &st, 0);
-    if(i == n-1 ){
-      last_status = st;
-    }
-  }
+    case node::IF:
+      return with_redirs(n, [&]{
+        size_t k = 0;
+        for(; k + 1 < n.kids.size(); k += 2){
+          int cond = exec_node(*n.kids[k]);
+          if(ctl_pending()) return cond;
+          if(cond == 0) return exec_node(*n.kids[k + 1]);
+        }
+        return k < n.kids.size() ? exec_node(*n.kids[k]) : 0;
+      });
+
+    case node::WHILE:
+    case node::UNTIL:
+      return with_redirs(n, [&]{
+        int st = 0;
+        loop_depth++;
+        while(true){
+          int cond = exec_node(*n.kids[0]);
+          if(ctl_pending() && loop_should_stop()) break;
+          if((cond == 0) != (n.kind == node::WHILE)) break;
+          st = exec_node(*n.kids[1]);
+          if(ctl_pending() && loop_should_stop()) break;
+        }
+        loop_depth--;
+        return st;
+      });
+
+    case node::FOR:
+      return with_redirs(n, [&]{
+        std::vector<std::string> items;
+        if(n.for_in){
+          for(auto& w : n.words){
+            expand_plan(w, items);
+          }
+        }
+        else{
+          items = positional();
+        }
+
+        int st = 0;
+        loop_depth++;
+        for(auto& item : items){
+          var_set(n.var, item);
+          st = exec_node(*n.kids[0]);
+          if(ctl_pending() && loop_should_stop()) break;
+        }
+        loop_depth--;
+        return st;
+      });
 
-  if(WIFEXITED(last_status)){
-    return WEXITSTATUS(last_status);
+    case node::FUNCDEF:
+      functions[n.cmd.argv[0]] = n.fn;
+      return 0;
   }
   return 1;
-
 }
 
-bool expand_history(std::string& cmd, const std::vector<std::string>& history){
+bool expand_history(std::string& cmd, const std::vector<atom_t>& history){
   if(cmd.size() < 2 || cmd[0] != '!') return true;
 
   if(cmd.find(' ') != std::string::npos) return true;
@@ -889,7 +4993,7 @@ bool expand_history(std::string& cmd, const std::vector<std::string>& history){
         std::cerr << "history: event not found" << std::endl;
         return false;
       }
-      cmd = history.back();
+      cmd = atom_view(history.back());
       
       return true;
     }
@@ -901,7 +5005,7 @@ bool expand_history(std::string& cmd, const std::vector<std::string>& history){
         return false;
       }
 
-      cmd = history[history.size() - n];
+      cmd = atom_view(history[history.size() - n]);
       
       return true;
     }
@@ -913,7 +5017,7 @@ bool expand_history(std::string& cmd, const std::vector<std::string>& history){
       return false;
     }
 
-    cmd = history[idx -1 ];
+    cmd = atom_view(history[idx -1 ]);
     
     return true;
   }
@@ -924,30 +5028,683 @@ bool expand_history(std::string& cmd, const std::vector<std::string>& history){
 
 }
 
-int main() {
+//audit log: every command line run with its start time, cwd, duration and status, as
+//JSON lines in $AUDITFILE. The shell only copies a fixed-size record into a
+//single-producer/single-consumer ring; a writer thread formats the records, writes
+//them with one writev() per batch and fdatasync()s every $AUDITSYNC ms. A full ring
+//drops the record (counted in the next one written) instead of waiting.
+constexpr size_t AUDIT_RING = 256;            //records, a power of two
+constexpr size_t AUDIT_CMD_MAX = 1024;
+constexpr size_t AUDIT_CWD_MAX = 256;
+
+struct audit_record {
+  int64_t start_ns;       //CLOCK_REALTIME
+  int64_t duration_ns;
+  int32_t status;
+  int32_t pid;
+  uint32_t cmd_len;       //full length, only AUDIT_CMD_MAX bytes are kept
+  char cwd[AUDIT_CWD_MAX];
+  char cmd[AUDIT_CMD_MAX];
+};
+
+struct audit_log {
+  std::string path;
+  uint64_t max_size = 16 << 20;   //$AUDITSIZE bytes, then path is renamed to path.1
+  int sync_ms = 1000;             //$AUDITSYNC
+  int fd = -1;
+  int wake = -1;                  //eventfd the producer pokes
+  uint64_t size = 0;
+  std::unique_ptr<audit_record[]> ring{new audit_record[AUDIT_RING]};
+  alignas(64) std::atomic<size_t> head{0};   //next slot the shell writes
+  alignas(64) std::atomic<size_t> tail{0};   //next slot the writer reads
+  std::atomic<uint64_t> dropped{0};
+  std::atomic<bool> stop{false};
+  std::thread writer;
+};
+
+static std::unique_ptr<audit_log> audit;
+
+static int64_t audit_now(clockid_t clock){
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void json_escape(std::string& out, std::string_view s){
+  for(unsigned char ch : s){
+    if(ch == '"' || ch == '\\'){
+      out += '\\';
+      out += ch;
+    }
+    else if(ch == '\n') out += "\\n";
+    else if(ch == '\t') out += "\\t";
+    else if(ch < 0x20){
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", ch);
+      out += esc;
+    }
+    else out += ch;
+  }
+}
+
+static void audit_format(std::string& out, const audit_record& r, uint64_t dropped){
+  char head[128];
+  time_t secs = r.start_ns / 1000000000;
+  tm utc;
+  gmtime_r(&secs, &utc);
+  size_t n = strftime(head, sizeof(head), "{\"time\":\"%Y-%m-%dT%H:%M:%S", &utc);
+  snprintf(head + n, sizeof(head) - n, ".%06lldZ\",\"pid\":%d,\"status\":%d,\"duration_us\":%lld,",
+           (long long)(r.start_ns % 1000000000 / 1000), r.pid, r.status, (long long)(r.duration_ns / 1000));
+  out += head;
+  out += "\"cwd\":\"";
+  json_escape(out, std::string_view(r.cwd, strnlen(r.cwd, AUDIT_CWD_MAX)));
+  out += "\",\"cmd\":\"";
+  json_escape(out, std::string_view(r.cmd, std::min<size_t>(r.cmd_len, AUDIT_CMD_MAX)));
+  out += '"';
+  if(r.cmd_len > AUDIT_CMD_MAX) out += ",\"truncated\":true";
+  if(dropped) out += ",\"dropped\":" + std::to_string(dropped);
+  out += "}\n";
+}
+
+static bool audit_reopen(audit_log& a){
+  if(a.fd >= 0) close(a.fd);
+  a.fd = open(a.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  struct stat st;
+  a.size = (a.fd >= 0 && fstat(a.fd, &st) == 0) ? st.st_size : 0;
+  return a.fd >= 0;
+}
+
+//writer thread: drains the ring in batches until stop is set and the ring is empty
+static void audit_writer(audit_log& a){
+  std::vector<std::string> lines;
+  std::vector<iovec> iov;
+  int64_t last_sync = audit_now(CLOCK_MONOTONIC);
+  bool dirty = false;
+
+  while(true){
+    size_t tail = a.tail.load(std::memory_order_relaxed);
+    size_t head = a.head.load(std::memory_order_acquire);
+
+    if(tail != head){
+      lines.resize(head - tail);
+      iov.resize(head - tail);
+      size_t bytes = 0;
+      for(size_t i = tail; i != head; i++){
+        std::string& line = lines[i - tail];
+        line.clear();
+        audit_format(line, a.ring[i % AUDIT_RING], i == tail ? a.dropped.exchange(0) : 0);
+        iov[i - tail] = {line.data(), line.size()};
+        bytes += line.size();
+      }
+      //the records are copied out, so the shell can reuse their slots
+      a.tail.store(head, std::memory_order_release);
+
+      if(a.size + bytes > a.max_size && a.size > 0){
+        if(dirty) fdatasync(a.fd);
+        rename(a.path.c_str(), (a.path + ".1").c_str());
+        audit_reopen(a);
+        dirty = false;
+      }
+      if(a.fd >= 0){
+        //IOV_MAX is 1024, a batch is at most AUDIT_RING lines
+        ssize_t w = writev(a.fd, iov.data(), (int)iov.size());
+        if(w > 0){
+          a.size += w;
+          dirty = true;
+        }
+      }
+    }
+
+    int64_t now = audit_now(CLOCK_MONOTONIC);
+    if(dirty && (now - last_sync >= (int64_t)a.sync_ms * 1000000 || a.stop.load())){
+      fdatasync(a.fd);
+      dirty = false;
+      last_sync = now;
+    }
+
+    if(a.stop.load(std::memory_order_acquire) &&
+       a.tail.load(std::memory_order_relaxed) == a.head.load(std::memory_order_acquire)){
+      break;
+    }
+
+    pollfd pfd{a.wake, POLLIN, 0};
+    int timeout = dirty ? std::max<int>(1, a.sync_ms - (int)((now - last_sync) / 1000000)) : -1;
+    if(poll(&pfd, 1, timeout) > 0){
+      uint64_t v;
+      if(read(a.wake, &v, sizeof(v)) < 0){ /* drained by an earlier read */ }
+    }
+  }
+}
+
+//starts auditing when $AUDITFILE is set
+static void audit_open(){
+  const char* file = var_cstr("AUDITFILE");
+  if(!file || !*file) return;
+
+  auto a = std::make_unique<audit_log>();
+  a->path = file;
+  try{
+    if(const char* v = var_cstr("AUDITSIZE"); v && *v) a->max_size = std::stoull(v);
+    if(const char* v = var_cstr("AUDITSYNC"); v && *v) a->sync_ms = std::max(1, std::stoi(v));
+  }catch(...){
+    std::cerr << "audit: invalid AUDITSIZE or AUDITSYNC, using the defaults" << std::endl;
+  }
+  if(!audit_reopen(*a)){
+    perror(("audit: " + a->path).c_str());
+    return;
+  }
+  a->wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(a->wake < 0){
+    perror("audit: eventfd");
+    close(a->fd);
+    return;
+  }
+  audit_log& ref = *a;
+  a->writer = std::thread([&ref]{ audit_writer(ref); });
+  audit = std::move(a);
+}
+
+//flushes what is queued and stops the writer
+static void audit_close(){
+  if(!audit) return;
+  audit->stop.store(true, std::memory_order_release);
+  uint64_t one = 1;
+  if(write(audit->wake, &one, sizeof(one)) < 0){ /* counter full: the writer is awake anyway */ }
+  audit->writer.join();
+  close(audit->wake);
+  if(audit->fd >= 0) close(audit->fd);
+  audit.reset();
+}
+
+//what the shell fills in before a command runs; pushed by audit_end
+struct audit_start {
+  int64_t real_ns = 0;
+  int64_t mono_ns = 0;
+  char cwd[AUDIT_CWD_MAX];
+};
+
+static audit_start audit_begin(){
+  audit_start s;
+  if(!audit) return s;
+  s.real_ns = audit_now(CLOCK_REALTIME);
+  s.mono_ns = audit_now(CLOCK_MONOTONIC);
+  if(!getcwd(s.cwd, AUDIT_CWD_MAX)) s.cwd[0] = '\0';
+  return s;
+}
+
+//copies the record into the ring; never blocks, drops the record when the ring is full
+static void audit_end(const audit_start& start, const std::string& cmd, int status){
+  if(!audit) return;
+  audit_log& a = *audit;
+  size_t head = a.head.load(std::memory_order_relaxed);
+  if(head - a.tail.load(std::memory_order_acquire) == AUDIT_RING){
+    a.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  audit_record& r = a.ring[head % AUDIT_RING];
+  r.start_ns = start.real_ns;
+  r.duration_ns = audit_now(CLOCK_MONOTONIC) - start.mono_ns;
+  r.status = status;
+  r.pid = getpid();
+  r.cmd_len = cmd.size();
+  memcpy(r.cmd, cmd.data(), std::min(cmd.size(), AUDIT_CMD_MAX));
+  memcpy(r.cwd, start.cwd, AUDIT_CWD_MAX);
+  a.head.store(head + 1, std::memory_order_release);
+
+  uint64_t one = 1;
+  if(write(a.wake, &one, sizeof(one)) < 0){ /* counter full: the writer is awake anyway */ }
+}
+
+//runs a whole script (no readline, no history), as the server workers do
+static int run_script(const std::string& text){
+  std::vector<std::string> tokens = tokenizer(text);
+  if(tokenizer_needs_more){
+    std::cerr << "warning: here-document delimited by end-of-file" << std::endl;
+    tokenizer_needs_more = false;
+  }
+  if(tokenizer_unclosed){
+    std::cerr << "error : unclosed " << tokenizer_unclosed << std::endl;
+    return 2;
+  }
+  if(tokens.empty()) return 0;
+
+  try{
+    std::unique_ptr<node> tree = parse_tokens(tokens);
+    if(tree) exec_node(*tree);
+  }
+  catch(const std::exception& e){
+    std::cerr << e.what() << std::endl;
+    return 2;
+  }
+  return shell_exit_requested ? shell_exit_status : last_status;
+}
+
+//server mode: one warmed shell forks a worker per connection. The client passes its
+//stdin, stdout, stderr and cwd with SCM_RIGHTS, then the script, then shuts down its
+//write side; the worker answers with the exit status as a 4 byte int.
+constexpr int SERVER_FDS = 4;
+
+//without XDG_RUNTIME_DIR the socket goes in /tmp/shell-<uid>, which has to be a 0700
+//directory of ours: whoever can bind the path receives the clients' fds and scripts
+static std::string default_socket_path(){
+  const char* dir = var_cstr("XDG_RUNTIME_DIR");
+  if(dir && *dir) return std::string(dir) + "/shell.sock";
+
+  std::string priv = "/tmp/shell-" + std::to_string(getuid());
+  if(mkdir(priv.c_str(), 0700) < 0 && errno != EEXIST){
+    perror(("shell: " + priv).c_str());
+    return "";
+  }
+  struct stat st;
+  if(lstat(priv.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)){
+    std::cerr << "shell: " << priv << ": not a private directory" << std::endl;
+    return "";
+  }
+  return priv + "/shell.sock";
+}
+
+//the other end of a connection runs as this user
+static bool peer_is_self(int fd){
+  ucred cred{};
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == getuid();
+}
+
+static bool make_sockaddr(const std::string& path, sockaddr_un& addr){
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path)){
+    std::cerr << "shell: socket path too long: " << path << std::endl;
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+//receives the fds and the script of one connection, false when it is malformed
+static bool recv_request(int conn, int fds[SERVER_FDS], std::string& script){
+  char buf[CAPTURE_CHUNK];
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(int) * SERVER_FDS)];
+  iovec iov{buf, sizeof(buf)};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+
+  ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  if(n < 0) return false;
+
+  int got = 0;
+  for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)){
+    if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+    int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for(int i = 0; i < count; i++){
+      int fd;
+      memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+      if(got < SERVER_FDS) fds[got++] = fd;
+      else close(fd);
+    }
+  }
+  if(got != SERVER_FDS || (msg.msg_flags & MSG_CTRUNC)){
+    for(int i = 0; i < got; i++) close(fds[i]);
+    return false;
+  }
+
+  script.assign(buf, n);
+  while((n = read(conn, buf, sizeof(buf))) > 0){
+    script.append(buf, n);
+  }
+  return true;
+}
+
+//worker: reads the request, the passed fds become 0, 1, 2 and the cwd, the script runs,
+//the status goes back
+[[noreturn]] static void serve_client(int conn){
+  //the server ignores SIGPIPE and SIGCHLD, the script and its commands must not
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGPIPE, SIG_DFL);
+  int fds[SERVER_FDS];
+  std::string script;
+  if(!recv_request(conn, fds, script)) _exit(1);
+
+  for(int i = 0; i < 3; i++){
+    dup2(fds[i], i);
+  }
+  if(fchdir(fds[3]) == 0){
+    std::error_code ec;
+    auto cwd = fs::current_path(ec);
+    if(!ec) var_set(var_intern("PWD"), cwd.string());
+  }
+  for(int i = 0; i < SERVER_FDS; i++){
+    if(fds[i] > 2) close(fds[i]);
+  }
+
+  //the server's writer thread did not survive the fork
+  audit_open();
+  audit_start started = audit_begin();
+  int32_t st = run_script(script);
+  audit_end(started, script, st);
+  audit_close();
+  std::cout.flush();
+  write_all(conn, (const char*)&st, sizeof(st));
+  _exit(st);
+}
+
+//clears the way for bind(): only a socket of ours that nobody listens on is removed
+static bool remove_stale_socket(const std::string& path, const sockaddr_un& addr){
+  struct stat st;
+  if(lstat(path.c_str(), &st) < 0) return errno == ENOENT;
+  if(!S_ISSOCK(st.st_mode) || st.st_uid != getuid()){
+    std::cerr << "shell: " << path << ": exists and is not our socket" << std::endl;
+    return false;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  bool live = probe >= 0 && connect(probe, (const sockaddr*)&addr, sizeof(addr)) == 0;
+  if(probe >= 0) close(probe);
+  if(live){
+    std::cerr << "shell: " << path << ": a server is already listening" << std::endl;
+    return false;
+  }
+  return unlink(path.c_str()) == 0 || errno == ENOENT;
+}
+
+static int run_server(const std::string& path){
+  //caches every worker inherits: history, PATH listing and command_hash
+  HISTFILE = get_histfile();
+  history_read_file(HISTFILE);
+  rebuild_path_exec_cache();
+
+  sockaddr_un addr;
+  if(!make_sockaddr(path, addr)) return 1;
+
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(lfd < 0){
+    perror("socket");
+    return 1;
+  }
+  if(!remove_stale_socket(path, addr)){
+    close(lfd);
+    return 1;
+  }
+  mode_t old_mask = umask(077);
+  int rc = bind(lfd, (sockaddr*)&addr, sizeof(addr));
+  umask(old_mask);
+  if(rc < 0 || listen(lfd, SOMAXCONN) < 0){
+    perror("bind");
+    close(lfd);
+    return 1;
+  }
+
+  //workers are never waited for
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  while(!shell_exit_requested){
+    int conn = accept4(lfd, nullptr, nullptr, SOCK_CLOEXEC);
+    if(conn < 0){
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      break;
+    }
+    if(!peer_is_self(conn)){
+      close(conn);
+      continue;
+    }
+
+    //the worker reads the request, so a slow client holds up only its own session
+    pid_t pid = fork();
+    if(pid == 0){
+      close(lfd);
+      serve_client(conn);
+    }
+    if(pid < 0) perror("fork");
+
+    close(conn);
+  }
+
+  close(lfd);
+  unlink(path.c_str());
+  return 1;
+}
+
+//client mode: hands this process's stdio and cwd to the server and waits for the status
+static int run_client(const std::string& path, const std::string& script){
+  sockaddr_un addr;
+  if(!make_sockaddr(path, addr)) return 1;
+
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(conn < 0 || connect(conn, (sockaddr*)&addr, sizeof(addr)) < 0){
+    perror("connect");
+    return 1;
+  }
+  //the fds and the script only go to a server of the same user
+  if(!peer_is_self(conn)){
+    std::cerr << "shell: " << path << ": server runs as another user" << std::endl;
+    close(conn);
+    return 1;
+  }
+
+  int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  int fds[SERVER_FDS] = {0, 1, 2, cwd};
+  alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(fds))];
+  memset(ctl, 0, sizeof(ctl));
+
+  //the first byte carries the fds, even for an empty script
+  char first = script.empty() ? '\n' : script[0];
+  iovec iov{&first, 1};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = ctl;
+  msg.msg_controllen = sizeof(ctl);
+  cmsghdr* c = CMSG_FIRSTHDR(&msg);
+  c->cmsg_level = SOL_SOCKET;
+  c->cmsg_type = SCM_RIGHTS;
+  c->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+  if(cwd < 0 || sendmsg(conn, &msg, MSG_NOSIGNAL) != 1){
+    perror("sendmsg");
+    return 1;
+  }
+  close(cwd);
+
+  if(script.size() > 1 && !write_all(conn, script.data() + 1, script.size() - 1)){
+    perror("write");
+    return 1;
+  }
+  shutdown(conn, SHUT_WR);
+
+  int32_t st = 1;
+  size_t got = 0;
+  while(got < sizeof(st)){
+    ssize_t n = read(conn, (char*)&st + got, sizeof(st) - got);
+    if(n < 0 && errno == EINTR) continue;
+    if(n <= 0){
+      std::cerr << "shell: server closed the connection" << std::endl;
+      return 1;
+    }
+    got += n;
+  }
+  close(conn);
+  return st;
+}
+
+//lazy startup: the prompt does not wait for history or the PATH cache. A thread reads
+//HISTFILE and builds the PATH cache while readline waits for the first line; until
+//startup_sync() has joined it, the main thread leaves history, the atom arena,
+//command_hash and the variables alone. The join happens when the first line is read,
+//on a command Tab, on the history keys, or from readline's event hook once the
+//thread is done, which is also when readline gets its history list.
+static std::thread startup_thread;
+static std::atomic<bool> startup_done{false};
+static bool startup_pending = false;
+
+//--startup-trace: each phase's start and end in ms since main
+static bool startup_trace = false;
+static int64_t startup_t0 = 0;
+
+struct startup_phase {
+  const char* name;
+  int64_t start_ns;
+  int64_t end_ns;
+};
+static std::vector<startup_phase> startup_phases;      //main thread
+static std::vector<startup_phase> startup_bg_phases;   //startup thread, read after the join
+
+template<class F>
+static void startup_step(std::vector<startup_phase>& log, const char* name, F&& fn){
+  int64_t t = audit_now(CLOCK_MONOTONIC);
+  fn();
+  if(startup_trace) log.push_back({name, t, audit_now(CLOCK_MONOTONIC)});
+}
+
+static void startup_print(const std::vector<startup_phase>& log, const char* where){
+  for(auto& p : log){
+    fprintf(stderr, "startup: %-28s %-10s %8.3f ms -> %8.3f ms (%.3f ms)\n", p.name, where,
+            (p.start_ns - startup_t0) / 1e6, (p.end_ns - startup_t0) / 1e6,
+            (p.end_ns - p.start_ns) / 1e6);
+  }
+}
+
+static void startup_begin(){
+  startup_pending = true;
+  startup_thread = std::thread([]{
+    //on a busy or single CPU the prompt goes first
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 10);
+    startup_step(startup_bg_phases, "history_read_file", []{ history_read_file(HISTFILE); });
+    startup_step(startup_bg_phases, "rebuild_path_exec_cache", []{ rebuild_path_exec_cache(); });
+    startup_done.store(true, std::memory_order_release);
+  });
+}
+
+static void startup_sync(){
+  if(!startup_pending) return;
+  startup_pending = false;
+  rl_event_hook = nullptr;
+
+  std::vector<startup_phase> phases;
+  startup_step(phases, "wait for startup thread", []{ startup_thread.join(); });
+  startup_step(phases, "add_history", []{
+    session_start_index = history.size();
+    for(atom_t h : history) add_history(atom_cstr(h));
+    using_history();   //a prompt already showing starts browsing at the newest entry
+  });
+
+  if(startup_trace){
+    bool in_prompt = RL_ISSTATE(RL_STATE_READCMD);
+    if(in_prompt) fputc('\n', stderr);
+    startup_print(startup_bg_phases, "[thread]");
+    startup_print(phases, "[sync]");
+    if(in_prompt){
+      rl_on_new_line();
+      rl_redisplay();
+    }
+  }
+}
+
+//readline polls this while it waits for a key
+static int startup_event_hook(){
+  if(startup_done.load(std::memory_order_acquire)) startup_sync();
+  return 0;
+}
+
+//history keys used before the startup thread finished wait for it first
+static int startup_previous_history(int count, int key){
+  startup_sync();
+  return rl_get_previous_history(count, key);
+}
+
+static int startup_reverse_search(int count, int key){
+  startup_sync();
+  return rl_reverse_search_history(count, key);
+}
+
+static void init_readline_startup(){
+  rl_event_hook = startup_event_hook;
+  rl_bind_keyseq("\\e[A", startup_previous_history);
+  rl_bind_keyseq("\\eOA", startup_previous_history);
+  rl_bind_key(CTRL('P'), startup_previous_history);
+  rl_bind_key(CTRL('R'), startup_reverse_search);
+}
+
+int main(int argc, char** argv) {
   // Flush after every std::cout / std:cerr
   std::cout << std::unitbuf;
   std::cerr << std::unitbuf;
 
-  HISTFILE = get_histfile();
-  stifle_history((int)HISTORY_LIMIT);
-  history_read_file(HISTFILE);
-  session_start_index = history.size();
-  for(auto& h : history) add_history(h.c_str());
+  //the zygote helper, started by the shell with its socket on fd 3
+  if(argc > 1 && std::string(argv[1]) == "--zygote-helper"){
+    run_zygote(3);
+  }
+
+  startup_t0 = audit_now(CLOCK_MONOTONIC);
+  if(argc > 1 && std::string(argv[1]) == "--startup-trace"){
+    startup_trace = true;
+    argc--;
+    argv++;
+  }
+  if(argc > 1 && std::string(argv[1]) == "--zygote"){
+    opt_zygote = true;
+    argc--;
+    argv++;
+  }
+
+  startup_step(startup_phases, "vars_import", []{ vars_import(environ); });
+
+  //shell --server [socket] | shell --client [socket] [-c script]
+  if(argc > 1){
+    std::string mode = argv[1];
+    std::string path;
+    int i = 2;
+    if(i < argc && std::string(argv[i]) != "-c") path = argv[i++];
+    if(path.empty()) path = default_socket_path();
+    if(path.empty()) return 1;
+
+    if(mode == "--server") return run_server(path);
+
+    if(mode == "--client"){
+      std::string script;
+      if(i + 1 < argc && std::string(argv[i]) == "-c"){
+        script = argv[i + 1];
+      }
+      else{
+        read_all(0, script);
+      }
+      return run_client(path, script);
+    }
+
+    std::cerr << "usage: shell [--startup-trace] [--zygote] [--server [socket] | --client [socket] [-c script]]" << std::endl;
+    return 2;
+  }
 
-  init_readline_completion();
+  startup_step(startup_phases, "get_histfile", []{ HISTFILE = get_histfile(); });
+  startup_step(startup_phases, "audit_open", []{ audit_open(); });
+  startup_step(startup_phases, "readline setup", []{
+    stifle_history((int)HISTORY_LIMIT);
+    init_readline_completion();
+    init_readline_startup();
+  });
+  //the helper starts before any thread does
+  if(opt_zygote) startup_step(startup_phases, "zygote_start", []{ zygote_start(); });
+  startup_step(startup_phases, "start startup thread", []{ startup_begin(); });
+
+  if(startup_trace){
+    startup_print(startup_phases, "[main]");
+    fprintf(stderr, "startup: first prompt at %.3f ms\n", (audit_now(CLOCK_MONOTONIC) - startup_t0) / 1e6);
+  }
 
   while(true){
     
     char* line = readline("$ ");
+    startup_sync();
     if(!line){
       std::cout << std::endl;
-      if constexpr (HIST_MODE == histpersistence::APPEND){
-        history_append_file(HISTFILE, session_start_index);
-      }
-      else {
-        history_write_file(HISTFILE);
-      }
+      shell_exit_status = last_status;
+      history_save();
       break;
     }
 
@@ -974,8 +5731,63 @@ int main() {
 
     std::vector<std::string> tokens;
     tokens = tokenizer(cmd);
+
+    //heredoc bodies, open quotes or substitutions and unfinished constructs continue
+    //on the next lines
+    std::unique_ptr<node> tree;
+    while(!tokens.empty() || tokenizer_unclosed){
+      bool incomplete = tokenizer_needs_more || tokenizer_unclosed;
+      if(!incomplete){
+        try{
+          tree = parse_tokens(tokens);
+        }
+        catch(const incomplete_input&){
+          incomplete = true;
+        }
+        catch(const std::exception& e){
+          std::cerr << e.what() << std::endl;
+        }
+      }
+      if(!incomplete) break;
+
+      char* more = readline("> ");
+      if(!more){
+        if(tokenizer_needs_more){
+          std::cerr << "warning: here-document delimited by end-of-file" << std::endl;
+          tokens = tokenizer(cmd);
+          tokenizer_needs_more = false;
+          continue;
+        }
+        if(tokenizer_unclosed){
+          std::cerr << "error : unclosed " << tokenizer_unclosed << std::endl;
+          tokenizer_unclosed = nullptr;
+          break;
+        }
+        std::cerr << incomplete_input().what() << std::endl;
+        break;
+      }
+      cmd += '\n';
+      cmd += more;
+
+      //inside a heredoc body only the delimiter line can change the tokens
+      if(tokenizer_needs_more){
+        std::string_view l(more);
+        if(tokenizer_heredoc_strip){
+          while(!l.empty() && l[0] == '\t') l.remove_prefix(1);
+        }
+        if(l != tokenizer_heredoc_delim){
+          free(more);
+          continue;
+        }
+      }
+      free(more);
+      tokens = tokenizer(cmd);
+    }
+
     if(tokens.empty()) continue;
 
+    glob_cache_clear();
+
     bool store_in_history = true;
     if(tokens[0] == "history"){
 
@@ -987,86 +5799,29 @@ int main() {
       }
     }
 
-    if(store_in_history){
-      history.push_back(cmd);
-
-      if(history.size() > HISTORY_LIMIT){
-        size_t extra = history.size() - HISTORY_LIMIT;
-        history.erase(history.begin() , history.begin() + extra);
-      }
-
+    if(store_in_history && history_add(cmd)){
       add_history(cmd.c_str());
     }
 
-    bool has_pipes = false;
-    for(auto& t : tokens){
-      if(t == "|"){
-        has_pipes = true;
-        break;
-      }
-    }
+    if(!tree) continue;
 
     // main command loop
+    audit_start started = audit_begin();
     try{
-
-      if(has_pipes){
-        auto cmds = parse_pipeline(tokens);
-        execute_pipeline(cmds);
-        continue;
-      }
-
-      auto [argv_str, redirs] = RD_tokens(tokens);
-      if(argv_str.empty()) continue;
-
-      if (is_Builtin(argv_str[0])){
-        FDSave saved = save_FD();
-        if(!RD_apply(redirs,false)) {
-          restorFD(saved);
-          continue;
-        }
-         
-        if(argv_str[0] ==  "exit"){
-          restorFD(saved);
-          if constexpr (HIST_MODE == histpersistence::APPEND){
-            history_append_file(HISTFILE, session_start_index);
-          }
-          else {
-            history_write_file(HISTFILE);
-          }
-          break;
-        }
-
-        run_builtin(argv_str, false);
-        restorFD(saved);
-        continue;
-
-      }
-
-      std::vector<char*> argv = make_argv(argv_str);
-
-      pid_t pid = fork();
-      if(pid < 0){
-        perror("fork");
-        continue;
-      }
-
-      if(pid == 0) {
-        if(!RD_apply(redirs,true)){
-          _exit(1);
-        }
-        execvp(argv[0], argv.data());
-        std::cerr << argv_str[0] << ": not found" << std::endl;
-        _exit(127);
-      }
-      else{
-        int status;
-        waitpid(pid, &status, 0);
+      exec_node(*tree);
+      audit_end(started, cmd, shell_exit_requested ? shell_exit_status : last_status);
+      if(shell_exit_requested){
+        history_save();
+        break;
       }
-
     }
     catch(const std::exception& e){
+      audit_end(started, cmd, 1);
       std::cerr << e.what() << std::endl;
       continue;
     }
   }
+
+  audit_close();
+  return shell_exit_status;
 }